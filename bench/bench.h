@@ -0,0 +1,79 @@
+// minimal benchmark harness : every case runs until min_seconds have passed,
+// results are printed and optionally written as json for tracking between builds.
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <boost/format.hpp>
+
+class BenchmarkSuite
+{
+public :
+	struct Result
+	{
+		std::string name;
+		long iterations;
+		double ns_per_iter;
+	};
+
+	double min_seconds;
+	std::string filter;
+	std::vector<Result> results;
+
+	BenchmarkSuite(double min_seconds = 1.0, const std::string& filter = "")
+	: min_seconds(min_seconds), filter(filter)
+	{}
+
+	bool is_selected(const std::string& name) const
+	{
+		return filter.empty() || name.find(filter) != std::string::npos;
+	}
+
+	// fn runs one iteration; batches grow until a batch takes ~10% of min_seconds
+	template <typename Fn>
+	void run(const std::string& name, Fn fn)
+	{
+		if (!is_selected(name)) return;
+
+		typedef std::chrono::steady_clock clock;
+
+		fn();
+
+		long batch = 1, iterations = 0;
+		double elapsed = 0;
+		while (elapsed < min_seconds)
+		{
+			auto start = clock::now();
+			for (long i=0; i<batch; ++i)
+			{
+				fn();
+			}
+			const double seconds = std::chrono::duration<double>(clock::now() - start).count();
+			elapsed += seconds;
+			iterations += batch;
+			if (seconds < min_seconds / 10) batch *= 2;
+		}
+
+		Result r{name,iterations,elapsed * 1e9 / iterations};
+		results.push_back(r);
+		std::cout << boost::str(boost::format("%-40s %12ld iters %14.1f ns/iter\n")%r.name%r.iterations%r.ns_per_iter) << std::flush;
+	}
+
+	void write_json(const std::string& file, const std::vector<std::pair<std::string,long>>& context = {}) const
+	{
+		std::ofstream out(file);
+		out << "{\n  \"context\": {";
+		for (int i=0; i<context.size(); ++i)
+		{
+			out << (i ? ", " : "") << "\"" << context[i].first << "\": " << context[i].second;
+		}
+		out << "},\n  \"benchmarks\": [";
+		for (int i=0; i<results.size(); ++i)
+		{
+			const auto& r = results[i];
+			out << (i ? "," : "") << boost::str(boost::format("\n    {\"name\": \"%s\", \"iterations\": %ld, \"ns_per_iter\": %.3f}")%r.name%r.iterations%r.ns_per_iter);
+		}
+		out << "\n  ]\n}\n";
+	}
+};
@@ -0,0 +1,115 @@
+// per-decision cost of the callbacks handed down the decision path:
+// std::function (as Brain::forward / DeepNetwork::predict used to take them) versus templated callables.
+// both read the same precomputed action mask, so the difference is the callback alone.
+#include <array>
+#include <bitset>
+#include <functional>
+#include "bench.h"
+
+enum { num_actions = 7 };
+enum { epsilon_period = 10 };
+
+typedef std::bitset<num_actions> ActionMask;
+
+struct Actable
+{
+	unsigned seed;
+	ActionMask action_mask;
+
+	Actable() : seed(1) { action_mask = ActionMask(0x5d); }
+	virtual ~Actable() {}
+
+	virtual int random_action()
+	{
+		seed = seed * 1103515245 + 12345;
+		int nth = (seed >> 16) % action_mask.count();
+		for (int action=0;; ++action)
+		{
+			if (action_mask[action] && nth-- == 0)
+			{
+				return action;
+			}
+		}
+	}
+};
+
+struct Network
+{
+	std::array<float,num_actions> q;
+	int decisions;
+
+	Network() : decisions(0)
+	{
+		for (int action=0; action<num_actions; ++action)
+		{
+			q[action] = (action * 7919) % 13 - 6.0f;
+		}
+	}
+
+	// baseline: what predict + get_policy did with a std::function callback
+	__attribute__((noinline)) int predict_function(const ActionMask& mask,std::function<int()> random_action)
+	{
+		if (++decisions % epsilon_period == 0)
+		{
+			return random_action();
+		}
+
+		int best = -1;
+		float best_val = -1e30f;
+		for (int action=0; action<num_actions; ++action)
+		{
+			if (mask[action] && q[action] > best_val)
+			{
+				best = action;
+				best_val = q[action];
+			}
+		}
+		return best < 0 ? random_action() : best;
+	}
+
+	template <typename RandomAction>
+	__attribute__((noinline)) int predict_template(const ActionMask& mask,const RandomAction& random_action)
+	{
+		if (++decisions % epsilon_period == 0)
+		{
+			return random_action();
+		}
+
+		int best = -1;
+		float best_val = -1e30f;
+		for (int action=0; action<num_actions; ++action)
+		{
+			if (mask[action] && q[action] > best_val)
+			{
+				best = action;
+				best_val = q[action];
+			}
+		}
+		return best < 0 ? random_action() : best;
+	}
+};
+
+// usage : bench_callbacks [json_file]
+int main(int argc, char** argv)
+{
+	Network net;
+	Actable hero;
+	Actable* agent = &hero;
+	volatile int sink = 0;
+
+	BenchmarkSuite suite;
+
+	suite.run("decision/std_function",[&]{
+		sink = net.predict_function(agent->action_mask,[&]{return agent->random_action();});
+	});
+
+	suite.run("decision/template",[&]{
+		sink = net.predict_template(agent->action_mask,[&]{return agent->random_action();});
+	});
+
+	if (argc > 1)
+	{
+		suite.write_json(argv[1]);
+	}
+	return 0;
+}
@@ -0,0 +1,396 @@
+#include "caffe/caffe.hpp"
+#include <list>
+#include <boost/format.hpp>
+#include <random>
+
+using caffe::Caffe;
+using caffe::Net;
+using caffe::Layer;
+using caffe::shared_ptr;
+using caffe::vector;
+using caffe::Blob;
+using boost::str;
+using boost::format;
+
+DEFINE_string(solver, "dqn_solver.prototxt",  "The solver definition protocol buffer text file.");
+DEFINE_string(bench_json, "", "write results to this json file");
+DEFINE_string(bench_filter, "", "only run benchmarks whose name contains this");
+DEFINE_double(bench_min_time, 1.0, "seconds spent on each benchmark");
+
+#include "dqn.h"
+#include "game.h"
+#include "scenario.h"
+#include "league.h"
+#include "fused_conv.h"
+#include "bench.h"
+
+// fixtures never read the terminal
+bool is_keypressed(char c)
+{
+	return false;
+}
+
+// deterministic fixtures for the hot paths; run from the directory holding dqn_solver.prototxt.
+template <typename G>
+class Fixture
+{
+public :
+	typedef DeepNetwork<G> Network;
+	typedef typename Network::SingleFrameSp SingleFrameSp;
+	typedef typename Network::Experience Experience;
+	typedef typename Network::InputFrames InputFrames;
+
+	RandomStream random;
+	Environment env;
+	GameState game_state;
+	boost::shared_ptr<Network> dqn;
+	int num_worlds;
+
+	Fixture()
+	: random(1234), env(random.fork(RS_learners)), num_worlds(0)
+	{
+		dqn.reset(new Network(env,FLAGS_solver));
+	}
+
+	SingleFrameSp random_frame()
+	{
+		auto frame = new RasterFrame<G>;
+		for (auto& image : frame->images)
+		{
+			random.fill_uniform(image.data(),image.size(),-1,1);
+		}
+		random.fill_uniform(frame->stats.data(),frame->stats.size(),-1,1);
+		return SingleFrameSp(frame);
+	}
+
+	Experience random_experience()
+	{
+		Experience e;
+		for (auto& f : e.input_frames) f = random_frame();
+		e.next_frame = random_frame();
+		e.action = env.randint(num_actions);
+		e.reward = random.uniform() * 2 - 1;
+		return e;
+	}
+
+	InputFrames random_input_frames()
+	{
+		InputFrames frames;
+		for (auto& f : frames) f = random_frame();
+		return frames;
+	}
+
+	// world with num_agents heroes alternating teams, each driven by dqn
+	boost::shared_ptr<World> populated_world(int num_agents)
+	{
+		boost::shared_ptr<World> w(new World(random.fork(RS_worlds).fork(num_worlds++),game_state));
+		for (int i=0; i<num_agents; ++i)
+		{
+			const int team = i % 2;
+			auto pawn = static_cast<Pawn*>(w->spawn([&]{return static_cast<Agent*>(new Hero(team));}));
+			pawn->brain.reset(new HeroBrain<G>(dqn,w.get()));
+			Vector pos;
+			do
+			{
+				pos = w->random_location();
+			} while (!w->is_vacant(pos,pawn));
+			w->place(pawn,pos);
+		}
+		return w;
+	}
+};
+
+// largest |a - b| relative to the largest |a|, over n values
+float relative_error(const float* a, const float* b, int n)
+{
+	float scale = 0, error = 0;
+	for (int i=0; i<n; ++i)
+	{
+		scale = std::max(scale,std::abs(a[i]));
+		error = std::max(error,std::abs(a[i] - b[i]));
+	}
+	return scale > 0 ? error / scale : error;
+}
+
+// the fused layer has to reproduce caffe's convolution followed by its in-place leaky relu : the top's data on forward, then
+// the bottom's, weights' and bias' diffs on backward from the same top diff. both share the convolution's parameter blobs.
+void check_fused_conv(const std::string& name, Layer<float>& conv, Layer<float>& relu,
+	const vector<Blob<float>*>& bottom, const vector<Blob<float>*>& top,
+	ConvLeakyReLULayer& fused, vector<Blob<float>*>& fused_bottom, vector<Blob<float>*>& fused_top, RandomStream& random)
+{
+	const float tolerance = 1e-4f;
+	const vector<bool> propagate_down(1,true);
+	auto& params = conv.blobs();
+
+	random.fill_uniform(bottom[0]->mutable_cpu_data(),bottom[0]->count(),-1,1);
+	std::copy(bottom[0]->cpu_data(),bottom[0]->cpu_data() + bottom[0]->count(),fused_bottom[0]->mutable_cpu_data());
+
+	conv.Forward(bottom,const_cast<vector<Blob<float>*>*>(&top));
+	relu.Forward(top,const_cast<vector<Blob<float>*>*>(&top));
+	fused.Forward(fused_bottom,&fused_top);
+	CHECK_EQ(top[0]->count(),fused_top[0]->count()) << name;
+	const float forward_error = relative_error(top[0]->cpu_data(),fused_top[0]->cpu_data(),top[0]->count());
+	CHECK_LE(forward_error,tolerance) << "fused " << name << " forward differs from caffe's conv + relu";
+
+	std::vector<float> top_diff(top[0]->count());
+	random.fill_uniform(top_diff.data(),top_diff.size(),-1,1);
+	auto zero_param_diffs = [&]{
+		for (auto& p : params)
+		{
+			std::fill(p->mutable_cpu_diff(),p->mutable_cpu_diff() + p->count(),0);
+		}
+	};
+
+	std::copy(top_diff.begin(),top_diff.end(),top[0]->mutable_cpu_diff());
+	zero_param_diffs();
+	relu.Backward(top,propagate_down,const_cast<vector<Blob<float>*>*>(&top));
+	conv.Backward(top,propagate_down,const_cast<vector<Blob<float>*>*>(&bottom));
+	std::vector<std::vector<float>> expected;
+	expected.push_back(std::vector<float>(bottom[0]->cpu_diff(),bottom[0]->cpu_diff() + bottom[0]->count()));
+	for (auto& p : params)
+	{
+		expected.push_back(std::vector<float>(p->cpu_diff(),p->cpu_diff() + p->count()));
+	}
+
+	std::copy(top_diff.begin(),top_diff.end(),fused_top[0]->mutable_cpu_diff());
+	zero_param_diffs();
+	fused.Backward(fused_top,propagate_down,&fused_bottom);
+
+	const char* what[] = {"bottom", "weight", "bias"};
+	for (int k=0; k<expected.size(); ++k)
+	{
+		const float* actual = k == 0 ? fused_bottom[0]->cpu_diff() : params[k-1]->cpu_diff();
+		const float error = relative_error(expected[k].data(),actual,expected[k].size());
+		CHECK_LE(error,tolerance) << "fused " << name << " " << what[std::min(k,2)] << " diff differs from caffe's conv + relu";
+	}
+	LOG(INFO) << "fused " << name << " matches caffe's conv + relu, forward error " << forward_error;
+}
+
+template <typename G>
+int run_benchmarks()
+{
+	typedef DeepNetwork<G> Network;
+	typedef typename Network::InputFrames InputFrames;
+	enum { MinibatchSize = G::MinibatchSize };
+
+	// train as soon as one minibatch is stored
+	FLAGS_learning_steps_burnin = MinibatchSize;
+
+	Fixture<G> fixture;
+	auto& dqn = *fixture.dqn;
+	BenchmarkSuite suite(FLAGS_bench_min_time,FLAGS_bench_filter);
+
+	{
+		RandomStream stream(1234);
+		std::array<float,1024> values;
+		volatile int sink = 0;
+		suite.run("random/randint",[&]{ sink = stream.randint(num_actions); });
+		suite.run("random/fill_uniform:1024",[&]{ stream.fill_uniform(values.data(),values.size()); });
+	}
+
+	{
+		// stocked up front, so get_random has something to draw even when the filter skips replay/push
+		typename Network::ReplayMemory replay(dqn);
+		for (int k=0; k<MinibatchSize; ++k)
+		{
+			replay.push(fixture.random_experience());
+		}
+		const auto e = fixture.random_experience();
+		suite.run("replay/push",[&]{ replay.push(e); });
+		suite.run("replay/get_random",[&]{ replay.get_random(); });
+	}
+
+	{
+		typename Network::Feeder::Cursor cursor(dqn.feeder);
+		const auto frames = fixture.random_input_frames();
+		suite.run("cursor/write_frames",[&]{
+			cursor.begin();
+			for (int k=0; k<MinibatchSize; ++k)
+			{
+				cursor.write_frames(frames);
+				cursor.advance();
+			}
+		});
+	}
+
+	for (int num_agents : {2, 8, 32, 128})
+	{
+		auto w = fixture.populated_world(num_agents);
+		auto agent = static_cast<Actable*>(w->agents.front().get());
+		auto brain = static_cast<HeroBrain<G>*>(agent->brain.get());
+		suite.run(str(format("get_frame/agents:%d")%num_agents),[&]{ brain->get_frame(agent); });
+	}
+
+	{
+		// greedy inference only, so every decision runs the network and nothing is stored
+		dqn.epsilon.is_learning = false;
+		for (int num_agents : {2, 32})
+		{
+			auto w = fixture.populated_world(num_agents);
+			suite.run(str(format("world_tick/agents:%d")%num_agents),[&]{
+				if (w->quit) w = fixture.populated_world(num_agents);
+				w->tick();
+			});
+		}
+		dqn.epsilon.is_learning = true;
+	}
+
+	{
+		// the crowd scenario : ticks of brainless pawns, one pawn's observation, and ticks where every pawn decides greedily
+		const auto& crowd = find_scenario("crowd");
+		const int num_pawns = crowd.num_pawns();
+		EpisodeScheduler episodes(fixture.random,fixture.game_state,crowd);
+		auto next_episode = [&](bool with_brains) -> World&
+		{
+			fixture.game_state.epoch++;
+			return episodes.next([&](int team){return with_brains ? fixture.dqn : boost::shared_ptr<Network>();});
+		};
+
+		auto& w = next_episode(false);
+		suite.run(str(format("crowd/world_tick:%d")%num_pawns),[&]{
+			if (w.quit) next_episode(false);
+			w.tick();
+		});
+
+		next_episode(false);
+		HeroBrain<G> brain(fixture.dqn,&w);
+		auto observed = w.agents.begin();
+		suite.run(str(format("crowd/get_frame:%d")%num_pawns),[&]{
+			if (++observed == w.agents.end()) observed = w.agents.begin();
+			brain.get_frame(static_cast<Actable*>(observed->get()));
+		});
+
+		dqn.epsilon.is_learning = false;
+		next_episode(true);
+		const auto name = str(format("crowd/decide:%d")%num_pawns);
+		suite.run(name,[&]{
+			if (w.quit) next_episode(true);
+			w.tick();
+		});
+		if (!suite.results.empty() && suite.results.back().name == name)
+		{
+			std::cout << boost::str(boost::format("%-40s %12.0f decisions/s\n")%name%(num_pawns * 1e9 / suite.results.back().ns_per_iter)) << std::flush;
+		}
+		dqn.epsilon.is_learning = true;
+	}
+
+	{
+		EpisodeScheduler episodes(fixture.random,fixture.game_state,find_scenario(FLAGS_scenario));
+		suite.run("episode/next",[&]{
+			fixture.game_state.epoch++;
+			episodes.next([&](int team){return fixture.dqn;});
+		});
+	}
+
+	{
+		// a full pool, so every episode also freezes the learner and evicts the oldest snapshot
+		FLAGS_league_size = 8;
+		FLAGS_league_snapshot_interval = 1;
+		Network opponent(fixture.env,FLAGS_solver);
+		League<Network> league(dqn,opponent,fixture.random.fork(RS_league));
+		int epoch = 0;
+		suite.run("league/begin_episode",[&]{ league.begin_episode(++epoch); });
+		FLAGS_league_size = 0;
+	}
+
+	{
+		const auto frames = fixture.random_input_frames();
+		std::array<InputFrames,MinibatchSize> batch;
+		std::fill(batch.begin(),batch.end(),frames);
+
+		suite.run("evaluate/1",[&]{ dqn.eval_for_prediction.evaluate(std::array<InputFrames,1>{{frames}},ActionMask().set()); });
+		suite.run(str(format("evaluate/%d")%MinibatchSize),[&]{ dqn.eval_for_train.evaluate(batch,ActionMask().set()); });
+	}
+
+	{
+		// each conv + in-place leaky relu pair of the net, as caffe runs it and as one fused layer on the same weights.
+		// the fused layer is checked against the pair whatever the filter, then both are timed on random activations.
+		Network plain(fixture.env,FLAGS_solver);
+		auto& net = *plain.net;
+
+		auto index_of = [](Net<float>& net, const std::string& name) {
+			const auto& names = net.layer_names();
+			return int(std::find(names.begin(),names.end(),name) - names.begin());
+		};
+		auto randomize = [&](const vector<Blob<float>*>& blobs) {
+			for (auto b : blobs)
+			{
+				fixture.random.fill_uniform(b->mutable_cpu_data(),b->count(),-1,1);
+				fixture.random.fill_uniform(b->mutable_cpu_diff(),b->count(),-1,1);
+			}
+		};
+		const vector<bool> propagate_down(1,true);
+
+		for (std::string name : {"conv1_layer", "conv2_layer"})
+		{
+			const int i = index_of(net,name);
+			CHECK_LT(i + 1,net.layers().size()) << "no layer " << name;
+			auto conv = net.layers()[i], relu = net.layers()[i+1];
+			CHECK(relu->layer_param().type() == caffe::LayerParameter_LayerType_RELU) << name << " isn't followed by a relu";
+			auto bottom = net.bottom_vecs()[i];
+			auto top = net.top_vecs()[i];
+
+			Blob<float> fused_input, fused_output;
+			fused_input.ReshapeLike(*bottom[0]);
+			vector<Blob<float>*> fused_bottom(1,&fused_input), fused_top(1,&fused_output);
+			ConvLeakyReLULayer fused(conv->layer_param(),relu->layer_param().relu_param().negative_slope(),conv->blobs());
+			fused.SetUp(fused_bottom,&fused_top);
+
+			check_fused_conv(name,*conv,*relu,bottom,top,fused,fused_bottom,fused_top,fixture.random);
+
+			randomize(bottom);
+			randomize(top);
+			suite.run("conv/caffe:" + name,[&]{ conv->Forward(bottom,&top); relu->Forward(top,&top); });
+			suite.run("conv/caffe_backward:" + name,[&]{ relu->Backward(top,propagate_down,&top); conv->Backward(top,propagate_down,&bottom); });
+
+			randomize(fused_bottom);
+			randomize(fused_top);
+			suite.run("conv/fused:" + name,[&]{ fused.Forward(fused_bottom,&fused_top); });
+			suite.run("conv/fused_backward:" + name,[&]{ fused.Backward(fused_top,propagate_down,&fused_bottom); });
+		}
+	}
+
+	{
+		for (int i=0; i<MinibatchSize * 4; ++i)
+		{
+			dqn.trainer.push(fixture.random_experience());
+		}
+		suite.run("train/step",[&]{ dqn.train(); });
+	}
+
+	if (FLAGS_bench_json != "")
+	{
+		suite.write_json(FLAGS_bench_json,{
+			{"minibatch_size",MinibatchSize},
+			{"sight_diameter",G::sight_diameter},
+			{"temporal_window",G::temporal_window},
+			{"profiling",
+#ifdef DQN_PROFILE
+				1
+#else
+				0
+#endif
+			}});
+	}
+	return 0;
+}
+
+// with_geometry's callback : benchmarks the geometry --geometry named
+struct Benchmarks
+{
+	template <typename G>
+	int operator()(G) const
+	{
+		return run_benchmarks<G>();
+	}
+};
+
+int main(int argc, char** argv)
+{
+	caffe::GlobalInit(&argc,&argv);
+	Caffe::set_mode(Caffe::CPU);
+	Caffe::set_phase(Caffe::TRAIN);
+	CHECK(Philox4x32::passes_known_answers()) << "philox4x32-10 doesn't reproduce its known-answer vectors";
+
+	return with_geometry(FLAGS_geometry,Benchmarks());
+}
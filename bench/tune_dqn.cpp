@@ -0,0 +1,193 @@
+#include "caffe/caffe.hpp"
+#include <list>
+#include <boost/format.hpp>
+#include <random>
+#include <thread>
+#include <sstream>
+#include <boost/lexical_cast.hpp>
+#include <unistd.h>
+
+using caffe::Caffe;
+using caffe::Net;
+using caffe::Layer;
+using caffe::shared_ptr;
+using caffe::vector;
+using caffe::Blob;
+using boost::str;
+using boost::format;
+
+DEFINE_string(solver, "dqn_solver.prototxt",  "The solver definition protocol buffer text file.");
+DEFINE_string(tune_blas_threads, "", "comma separated blas thread counts to try; empty tries powers of two up to the core count");
+DEFINE_string(tune_learner_replicas, "", "comma separated --learner_replicas to try; empty tries powers of two up to the core count");
+DEFINE_double(tune_seconds, 5.0, "seconds measured for each setting, after training has started");
+DEFINE_double(tune_min_env_rate, 100, "world ticks per second a setting must sustain to be chosen");
+DEFINE_string(tune_output, "dqn.flags", "flag file to write the chosen setting to; pass it as ./dqn --flagfile=dqn.flags");
+
+#include "dqn.h"
+#include "game.h"
+#include "scenario.h"
+
+// the tuner never reads the terminal
+bool is_keypressed(char c)
+{
+	return false;
+}
+
+template <typename T>
+std::vector<T> parse_list(const std::string& list)
+{
+	std::vector<T> values;
+	std::istringstream in(list);
+	std::string item;
+	while (std::getline(in,item,','))
+	{
+		if (item != "") values.push_back(boost::lexical_cast<T>(item));
+	}
+	return values;
+}
+
+struct Setting
+{
+	int blas_threads;
+	int learner_replicas;
+	double env_rate, sgd_rate, sample_rate;
+
+	// acting and learning weigh alike : the geometric mean of world ticks/s and experiences trained on per second
+	double score() const
+	{
+		return std::sqrt(env_rate * sample_rate);
+	}
+};
+
+// one fresh network per setting, self-play on the chosen scenario at the given --train_ratio; only ticks after burn-in are timed
+template <typename G>
+void measure(Setting& s)
+{
+	set_blas_threads(s.blas_threads);
+	FLAGS_learner_replicas = s.learner_replicas;
+
+	// train as soon as one minibatch is stored
+	FLAGS_learning_steps_burnin = G::MinibatchSize;
+
+	RandomStream random(1234);
+	Environment env(random.fork(RS_learners));
+	GameState game_state;
+	boost::shared_ptr<DeepNetwork<G>> dqn(new DeepNetwork<G>(env,FLAGS_solver));
+	if (s.learner_replicas > 1)
+	{
+		dqn->trainer.parallel.reset(new DataParallel<DeepNetwork<G>>(*dqn));
+	}
+	const auto& scenario = find_scenario(FLAGS_scenario);
+
+	EpisodeScheduler episodes(random,game_state,scenario);
+	World* w = nullptr;
+	auto tick = [&]{
+		if (!w || w->quit)
+		{
+			game_state.epoch++;
+			w = &episodes.next([&](int team){return dqn;});
+		}
+		w->tick();
+		return dqn->train_tick();
+	};
+
+	while (!dqn->trainer.replay_memory.has_enough_samples(dqn->epsilon.learning_steps_burnin))
+	{
+		tick();
+	}
+
+	typedef std::chrono::steady_clock clock;
+	const auto start = clock::now();
+	long ticks = 0, sgd_steps = 0;
+	double elapsed = 0;
+	while (elapsed < FLAGS_tune_seconds)
+	{
+		sgd_steps += tick();
+		ticks++;
+		elapsed = std::chrono::duration<double>(clock::now() - start).count();
+	}
+
+	s.env_rate = ticks / elapsed;
+	s.sgd_rate = sgd_steps / elapsed;
+	s.sample_rate = s.sgd_rate * s.learner_replicas * G::MinibatchSize;
+}
+
+// with_geometry's callback : measures in the geometry --geometry named
+struct Measure
+{
+	Setting& s;
+
+	template <typename G>
+	int operator()(G) const
+	{
+		measure<G>(s);
+		return 0;
+	}
+};
+
+// sweeps the host knobs, blas threads x learner replicas, and keeps the best score among the settings that still run
+// the world at tune_min_env_rate. --train_ratio is a learning hyperparameter : it is held at its flag value and not written.
+// --eval_cores isn't swept either, it is the share of the host given to evaluation rather than a throughput knob.
+int main(int argc, char** argv)
+{
+	caffe::GlobalInit(&argc,&argv);
+	Caffe::set_mode(Caffe::CPU);
+	Caffe::set_phase(Caffe::TRAIN);
+
+	auto blas_threads = parse_list<int>(FLAGS_tune_blas_threads);
+	if (blas_threads.empty())
+	{
+		for (int n=1; n<=std::max(1u,std::thread::hardware_concurrency()); n *= 2)
+		{
+			blas_threads.push_back(n);
+		}
+	}
+	auto replicas = parse_list<int>(FLAGS_tune_learner_replicas);
+	if (replicas.empty())
+	{
+		for (int n=1; n<=std::max(1u,std::thread::hardware_concurrency()); n *= 2)
+		{
+			replicas.push_back(n);
+		}
+	}
+
+	std::vector<Setting> settings;
+	for (auto threads : blas_threads)
+	{
+		for (auto r : replicas)
+		{
+			Setting s = {threads,r,0,0,0};
+			with_geometry(FLAGS_geometry,Measure{s});
+			std::cout << str(format("blas_threads %3d learner_replicas %3d : %10.1f ticks/s %10.1f sgd steps/s %10.1f samples/s, score %.1f\n")
+				%s.blas_threads%s.learner_replicas%s.env_rate%s.sgd_rate%s.sample_rate%s.score()) << std::flush;
+			settings.push_back(s);
+		}
+	}
+
+	auto better = [](const Setting& a, const Setting& b) {
+		return a.score() > b.score();
+	};
+
+	const Setting* best = nullptr;
+	for (const auto& s : settings)
+	{
+		if (s.env_rate >= FLAGS_tune_min_env_rate && (!best || better(s,*best))) best = &s;
+	}
+	if (!best)
+	{
+		LOG(WARNING) << "no setting sustains " << FLAGS_tune_min_env_rate << " ticks/s, choosing the fastest world";
+		best = &*std::max_element(settings.begin(),settings.end(),[](const Setting& a, const Setting& b){return a.env_rate < b.env_rate;});
+	}
+
+	char host[256] = "";
+	gethostname(host,sizeof(host) - 1);
+
+	std::ofstream out(FLAGS_tune_output);
+	out << str(format("# tuned on %s with %s at train_ratio %g : %.1f ticks/s, %.1f sgd steps/s\n")%host%FLAGS_scenario%FLAGS_train_ratio%best->env_rate%best->sgd_rate);
+	out << "--geometry=" << FLAGS_geometry << "\n";
+	out << "--blas_threads=" << best->blas_threads << "\n";
+	out << "--learner_replicas=" << best->learner_replicas << "\n";
+
+	std::cout << str(format("chose blas_threads %d learner_replicas %d, written to %s\n")%best->blas_threads%best->learner_replicas%FLAGS_tune_output);
+	return 0;
+}
@@ -1,22 +1,60 @@
-class Brain
+class World;
+class Actable;
+
+// what the game sees of a brain, whatever geometry the network behind it was built for
+class AgentBrain
+{
+public:
+	AgentBrain(World* world) : world(world) {}
+	virtual ~AgentBrain() {}
+
+	World* world;
+
+	virtual int forward(Actable* agent) = 0;
+	virtual void backward(float reward) = 0;
+	virtual void reset() = 0;
+	// the agent's episode is over; stores the pending decision without a next frame
+	virtual void end_episode() = 0;
+	virtual float gamma() const = 0;
+	virtual std::string detail() const = 0;
+};
+
+template <typename G>
+class Brain : public AgentBrain
 {
 public:
-	typedef boost::shared_ptr<DeepNetwork> NetworkSp;
+	typedef DeepNetwork<G> Network;
+	typedef boost::shared_ptr<Network> NetworkSp;
+	typedef typename Network::SingleFrameSp SingleFrameSp;
+	typedef typename Network::Experience Experience;
 
 	int forward_passes;
+	int repeat_ticks;
 	
 	NetworkSp network;
 	Experience current_experience;
 
 	bool has_pending_experience;
 
-	Brain(NetworkSp network)
-	: forward_passes(0), has_pending_experience(false), network(network)
+	Brain(NetworkSp network, World* world)
+	: AgentBrain(world), forward_passes(0), repeat_ticks(0), has_pending_experience(false), network(network)
 	{
 		last_non_random_p.val = -1;
 		last_non_random_p.action = -1;
 	}
 
+	// back to a fresh episode; the deque and experience keep their storage
+	virtual void reset()
+	{
+		forward_passes = 0;
+		repeat_ticks = 0;
+		has_pending_experience = false;
+		current_experience = Experience();
+		frame_window.clear();
+		last_non_random_p.val = -1;
+		last_non_random_p.action = -1;
+	}
+
 	void flush(SingleFrameSp next_frame)
 	{
 		if (has_pending_experience)
@@ -33,21 +71,47 @@ public:
 		}
 	}
 
+	virtual void end_episode()
+	{
+		flush(SingleFrameSp());
+	}
+
+	virtual float gamma() const
+	{
+		return network->trainer.gamma;
+	}
+
 	Policy last_p, last_non_random_p;
+
+	// true while the last decision should be held (and the frame not rendered) this tick
+	bool should_repeat(const ActionMask& mask)
+	{
+		if (repeat_ticks > 0 && mask[current_experience.action])
+		{
+			repeat_ticks--;
+			return true;
+		}
+		repeat_ticks = 0;
+		return false;
+	}
 	
-	std::string detail() const { return str(format("%s%s")%last_non_random_p.to_string()%(last_p.is_random()? str(format(" *RAND* %d")%last_p.action):"")); }
+	virtual std::string detail() const { return str(format("%s%s")%last_non_random_p.to_string()%(last_p.is_random()? str(format(" *RAND* %d")%last_p.action):"")); }
 
-	int forward(SingleFrameSp frame,std::function<int()> random_action,std::function<bool(int)> is_valid_action)
+	template <typename RandomAction>
+	int forward(SingleFrameSp frame,const ActionMask& mask,const RandomAction& random_action)
 	{
 		forward_passes++;
 		
 		flush(frame);
 
-		if (forward_passes > temporal_window + 1)
+		current_experience.reward = 0;
+		repeat_ticks = FLAGS_action_repeat - 1;
+
+		if (forward_passes > G::temporal_window + 1)
 		{
 			has_pending_experience = network->epsilon.is_learning;
 			std::copy(frame_window.begin(), frame_window.end(), current_experience.input_frames.begin());
-			auto p = network->predict(current_experience.input_frames,random_action,is_valid_action);
+			auto p = network->predict(current_experience.input_frames,mask,random_action);
 			last_p = p;
 			if (!p.is_random())
 			{
@@ -68,9 +132,10 @@ public:
 		return current_experience.action;
 	}
 
-	void backward(float reward)
+	// rewards of repeated ticks add up onto the decision that caused them
+	virtual void backward(float reward)
 	{
-		current_experience.reward = reward;		
+		current_experience.reward = std::min(1.0f,std::max(-1.0f,current_experience.reward + reward));
 	}	
 	
 	std::deque<SingleFrameSp> frame_window;
@@ -1,25 +1,54 @@
 // fix
-enum { temporal_window = 3 };	
-enum { sight_diameter = 8 };
-enum { world_size = sight_diameter };
-enum { sight_area = sight_diameter * sight_diameter };
 enum { max_skills = 2 };
 enum { num_move_dirs = 4 };
 enum { num_actions = 1 + num_move_dirs + max_skills };
 enum { channels = 5 + max_skills };
-
-enum { MinibatchSize = 32 };
 enum { num_stats = 4 + max_skills };
 enum { OutputCount = num_actions };
-enum { ImageSize = sight_area * channels };
-enum { window_length = temporal_window + 1 };
-enum { ImageChannels = window_length * channels };
-enum { StatChannels = window_length * num_stats };
-enum { InputDataSize = window_length * ImageSize };
 
 enum { HiddenLayerSize = 256 };
 enum { ImageFeatureSize = 32 };
 enum { LowLevelImageFeatureSize = 16 };
 
 enum { LowLevelKernelSize = 4 };
-enum { KernelSize = 4 };
\ No newline at end of file
+enum { KernelSize = 4 };
+
+DEFINE_string(geometry, "8x3x32", "sight diameter x temporal window x minibatch size, one of the instantiations in with_geometry");
+
+// observation and batch sizes; frames, experiences, networks and brains are templated on one of these
+template <int SightDiameter, int TemporalWindow, int BatchSize>
+struct Geometry
+{
+	enum { temporal_window = TemporalWindow };
+	enum { sight_diameter = SightDiameter };
+	enum { sight_area = sight_diameter * sight_diameter };
+
+	enum { MinibatchSize = BatchSize };
+	enum { ImageSize = sight_area * channels };
+	enum { window_length = temporal_window + 1 };
+	enum { ImageChannels = window_length * channels };
+	enum { StatChannels = window_length * num_stats };
+	enum { InputDataSize = window_length * ImageSize };
+
+	static std::string name()
+	{
+		return str(format("%dx%dx%d")%sight_diameter%temporal_window%MinibatchSize);
+	}
+};
+
+// runs fn(G()) for the geometry called name. the conv stack needs a sight of at least 8,
+// and every entry is a full instantiation of the program, so the list stays short.
+template <typename Fn>
+int with_geometry(const std::string& name, Fn fn)
+{
+#define GEOMETRY(sight,window,batch) if (name == Geometry<sight,window,batch>::name()) return fn(Geometry<sight,window,batch>());
+	GEOMETRY(8,3,32)
+	GEOMETRY(8,3,64)
+	GEOMETRY(8,3,128)
+	GEOMETRY(8,1,32)
+	GEOMETRY(12,3,32)
+	GEOMETRY(16,3,32)
+#undef GEOMETRY
+	LOG(FATAL) << "geometry " << name << " is not instantiated; add it to with_geometry";
+	return -1;
+}
@@ -0,0 +1,182 @@
+#include <pthread.h>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+DEFINE_int32(learner_replicas, 1, "networks computing the learner's gradients in parallel, each on its own minibatch; 1 trains on the calling thread only");
+DEFINE_bool(pin_learner_threads, true, "with --learner_replicas, pin each replica's thread to its own core");
+
+// synchronous data parallelism for a learning network. an sgd step draws learner_replicas minibatches from the master's
+// replay memory; replica 0 is the master on the calling thread, the others are inference networks on worker threads
+// whose parameter blobs share the master's memory. each computes its gradients into its own diffs, a tree reduction
+// sums them into the master's (replica r adds in r + 2^s at round s, waiting on that one's round counter, no locks),
+// and the master's solver applies one update to the average, which every replica sees through the shared parameters.
+template <typename Network>
+class DataParallel
+{
+public :
+	DataParallel(Network& master)
+	: master(master), replicas(1,&master), losses(FLAGS_learner_replicas), rounds(new std::atomic<int>[FLAGS_learner_replicas]),
+	  generation(0), stopping(false)
+	{
+		CHECK_GT(FLAGS_learner_replicas,1);
+		CHECK(master.solver) << "only a learning network can be replicated";
+		CHECK(Caffe::mode() == Caffe::CPU) << "data-parallel learners run on cpu only";
+
+		for (int r=1; r<FLAGS_learner_replicas; ++r)
+		{
+			auto n = inference_network<Network>(master.env);
+			share_params(*master.net,*n->net);
+			replicas.push_back(n.get());
+			owned.push_back(n);
+		}
+
+		for (int r=1; r<replicas.size(); ++r)
+		{
+			workers.push_back(std::thread([this,r]{ work(r); }));
+		}
+	}
+
+	~DataParallel()
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			stopping = true;
+		}
+		start.notify_all();
+		for (auto& t : workers)
+		{
+			t.join();
+		}
+	}
+
+	// one update from learner_replicas minibatches
+	void step()
+	{
+		{
+			PROFILE_SCOPE(train_sample);
+			for (auto r : replicas)
+			{
+				master.trainer.replay_memory.get_random(r->trainer.samples);
+			}
+		}
+
+		// a target network isn't shared across threads : its values are looked up here, the rest is left to the replicas
+		next_values.clear();
+		if (master.trainer.target)
+		{
+			PROFILE_SCOPE(train_target_forward);
+			for (auto r : replicas)
+			{
+				next_values.push_back(master.trainer.target->evaluate(r->trainer.samples));
+			}
+		}
+
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			for (int r=0; r<replicas.size(); ++r)
+			{
+				rounds[r].store(-1,std::memory_order_relaxed);
+			}
+			generation++;
+		}
+		start.notify_all();
+
+		compute(0);
+
+		const float scale = 1.0f / replicas.size();
+		for (const auto& p : master.net->params())
+		{
+			caffe::caffe_scal(p->count(),scale,p->mutable_cpu_diff());
+		}
+
+		{
+			PROFILE_SCOPE(train_update);
+			ExternalLossSolver::of(*master.solver).ApplyUpdate(losses[0] * scale);
+		}
+
+		Metrics::count(MC_sgd_steps);
+		master.metrics.loss.smooth(losses[0] * scale,0.01);
+	}
+
+private:
+	static void accumulate_diffs(caffe::Net<float>& from, caffe::Net<float>& into)
+	{
+		const auto& src = from.params();
+		const auto& dst = into.params();
+		for (int i=0; i<src.size(); ++i)
+		{
+			caffe::caffe_axpy(dst[i]->count(),1.0f,src[i]->cpu_diff(),dst[i]->mutable_cpu_diff());
+		}
+	}
+
+	void work(int r)
+	{
+		pin(r);
+
+		int done = 0;
+		for (;;)
+		{
+			{
+				std::unique_lock<std::mutex> lock(mutex);
+				start.wait(lock,[&]{ return stopping || generation != done; });
+				if (stopping) return;
+				done = generation;
+			}
+			compute(r);
+		}
+	}
+
+	// replica r's gradients, then its share of the reduction. rounds[r] counts the rounds r has finished,
+	// so a parent at round s waits for its child to reach s; a replica leaves once its parent will read it.
+	void compute(int r)
+	{
+		auto& trainer = replicas[r]->trainer;
+		losses[r] = trainer.compute_gradients(next_values.empty() ? trainer.evaluate_next_states() : next_values[r]);
+		rounds[r].store(0,std::memory_order_release);
+
+		PROFILE_SCOPE(train_reduce);
+		int round = 0;
+		for (int stride=1; stride<replicas.size() && r % (2 * stride) == 0; stride*=2, ++round)
+		{
+			const int child = r + stride;
+			if (child < replicas.size())
+			{
+				while (rounds[child].load(std::memory_order_acquire) < round)
+				{
+					std::this_thread::yield();
+				}
+				accumulate_diffs(*replicas[child]->net,*replicas[r]->net);
+				losses[r] += losses[child];
+			}
+			rounds[r].store(round + 1,std::memory_order_release);
+		}
+	}
+
+	// worker r on core r; the calling thread, replica 0, is left where the scheduler puts it
+	void pin(int r)
+	{
+		if (!FLAGS_pin_learner_threads) return;
+
+		cpu_set_t cpus;
+		CPU_ZERO(&cpus);
+		CPU_SET(r % std::max(1u,std::thread::hardware_concurrency()),&cpus);
+		if (pthread_setaffinity_np(pthread_self(),sizeof(cpus),&cpus) != 0)
+		{
+			LOG(WARNING) << "couldn't pin learner replica " << r;
+		}
+	}
+
+	Network& master;
+	std::vector<Network*> replicas;
+	std::vector<boost::shared_ptr<Network>> owned;
+	std::vector<float> losses;
+	std::vector<std::array<Policy,Network::MinibatchSize>> next_values; // per replica, when the master has a target network
+	std::unique_ptr<std::atomic<int>[]> rounds;
+
+	std::vector<std::thread> workers;
+	std::mutex mutex;
+	std::condition_variable start;
+	int generation;
+	bool stopping;
+};
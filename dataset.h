@@ -0,0 +1,423 @@
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <algorithm>
+#include <cstddef>
+#include <condition_variable>
+#include <deque>
+#include <mutex>
+#include <thread>
+
+DEFINE_string(dataset_dir, "", "append the learner's experiences to sharded files in this directory, for --train_dataset");
+DEFINE_int32(dataset_shard_records, 1 << 16, "experiences per dataset shard before the next one is started");
+DEFINE_string(train_dataset, "", "train the learner from the shards in this directory instead of playing; see --dataset_dir");
+DEFINE_int32(offline_steps, 100000, "with --train_dataset, sgd steps to run");
+DEFINE_int32(shuffle_buffer, 1 << 15, "with --train_dataset, experiences a minibatch is drawn from");
+DEFINE_int32(decoder_threads, 2, "with --train_dataset, threads turning mapped records into minibatches");
+
+// dataset shard : this header, then fixed-size records (DatasetRecord of the same geometry) to the end of the file.
+// the record count follows from the file size, so a shard cut short by a crash loses only its partial tail.
+struct DatasetShardHeader
+{
+	enum { magic_value = 0x54584544, current_version = 1 };
+
+	uint32_t magic;
+	uint32_t version;
+	int32_t sight_diameter;
+	int32_t window_length;
+	int32_t channels;
+	int32_t num_stats;
+	int32_t num_actions;
+	uint32_t record_bytes;
+
+	template <typename G>
+	static DatasetShardHeader of();
+
+	bool has_same_layout(const DatasetShardHeader& o) const
+	{
+		return std::memcmp(&sight_diameter,&o.sight_diameter,sizeof(*this) - offsetof(DatasetShardHeader,sight_diameter)) == 0;
+	}
+};
+
+// one experience rasterized : the window and the next frame as their network input, so reading never needs the game
+template <typename G>
+struct DatasetRecord
+{
+	enum { num_frames = G::window_length + 1 }; // the input window, then the next frame
+
+	float images[num_frames][G::ImageSize];
+	float stats[num_frames][num_stats];
+	uint32_t present; // bit per frame; absent frames (before an episode's start, after its end) are all zero
+	int32_t action;
+	float reward;
+	int32_t padding;
+
+	bool has_frame(int i) const { return present & (1u << i); }
+};
+
+template <typename G>
+DatasetShardHeader DatasetShardHeader::of()
+{
+	DatasetShardHeader h;
+	std::memset(&h,0,sizeof(h));
+	h.magic = magic_value;
+	h.version = current_version;
+	h.sight_diameter = G::sight_diameter;
+	h.window_length = G::window_length;
+	h.channels = ::channels;
+	h.num_stats = ::num_stats;
+	h.num_actions = ::num_actions;
+	h.record_bytes = sizeof(DatasetRecord<G>);
+	return h;
+}
+
+// appends experiences to shards named experience-NNNNNN.dat, numbered on from the highest already in the directory
+template <typename G>
+class DatasetWriter
+{
+public :
+	typedef ::Experience<G> Experience;
+	typedef DatasetRecord<G> Record;
+
+	DatasetWriter(const std::string& dir)
+	: dir(dir), next_shard(0), records(0)
+	{
+		CHECK_GT(FLAGS_dataset_shard_records,0);
+		while (access(shard_name(next_shard).c_str(),F_OK) == 0)
+		{
+			next_shard++;
+		}
+		open_shard();
+	}
+
+	void append(const Experience& e)
+	{
+		if (records == FLAGS_dataset_shard_records)
+		{
+			open_shard();
+		}
+
+		std::memset(&record,0,sizeof(record));
+		for (int i=0; i<Record::num_frames; ++i)
+		{
+			const auto frame = i < G::window_length ? e.input_frames[i].get() : e.next_frame.get();
+			if (frame)
+			{
+				frame->write(record.images[i],record.stats[i]);
+				record.present |= 1u << i;
+			}
+		}
+		record.action = e.action;
+		record.reward = e.reward;
+
+		out.write(reinterpret_cast<const char*>(&record),sizeof(record));
+		CHECK(out) << "failed writing " << shard_name(next_shard - 1);
+		records++;
+	}
+
+private:
+	std::string shard_name(int index) const
+	{
+		return str(format("%s/experience-%06d.dat")%dir%index);
+	}
+
+	void open_shard()
+	{
+		const auto file = shard_name(next_shard++);
+		out.close();
+		out.open(file, std::ios::binary | std::ios::trunc);
+		CHECK(out) << "couldn't open " << file;
+
+		const auto header = DatasetShardHeader::of<G>();
+		out.write(reinterpret_cast<const char*>(&header),sizeof(header));
+		records = 0;
+		LOG(INFO) << "writing experiences to " << file;
+	}
+
+	std::string dir;
+	int next_shard;
+	int records;
+	std::ofstream out;
+	Record record;
+};
+
+// every shard of a directory, mapped read-only. the page cache holds what is hot; nothing is copied up front.
+template <typename G>
+class DatasetShards
+{
+public :
+	typedef DatasetRecord<G> Record;
+
+	struct Shard
+	{
+		std::string file;
+		char* data;
+		size_t size;
+		const Record* records;
+		size_t count;
+	};
+
+	std::vector<Shard> shards;
+
+	DatasetShards(const std::string& dir)
+	{
+		std::vector<std::string> files;
+		DIR* d = opendir(dir.c_str());
+		CHECK(d) << "couldn't open " << dir;
+		while (auto entry = readdir(d))
+		{
+			const std::string name = entry->d_name;
+			if (name.size() > 4 && name.compare(name.size() - 4,4,".dat") == 0)
+			{
+				files.push_back(dir + "/" + name);
+			}
+		}
+		closedir(d);
+		std::sort(files.begin(),files.end());
+
+		for (const auto& file : files)
+		{
+			map(file);
+		}
+		CHECK(count() > 0) << "no experiences in " << dir;
+		LOG(INFO) << "dataset " << dir << " : " << count() << " experiences in " << shards.size() << " shards";
+	}
+
+	~DatasetShards()
+	{
+		for (const auto& s : shards)
+		{
+			munmap(s.data,s.size);
+		}
+	}
+
+	size_t count() const
+	{
+		size_t n = 0;
+		for (const auto& s : shards)
+		{
+			n += s.count;
+		}
+		return n;
+	}
+
+private:
+	void map(const std::string& file)
+	{
+		int fd = open(file.c_str(), O_RDONLY);
+		CHECK(fd >= 0) << "couldn't open " << file;
+
+		struct stat st;
+		CHECK(fstat(fd,&st) == 0);
+		const size_t size = st.st_size;
+		if (size <= sizeof(DatasetShardHeader))
+		{
+			close(fd);
+			LOG(WARNING) << file << " holds no experiences, skipped";
+			return;
+		}
+
+		char* data = static_cast<char*>(mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0));
+		close(fd);
+		CHECK(data != MAP_FAILED) << "couldn't map " << file;
+		madvise(data,size,MADV_SEQUENTIAL);
+
+		const auto& h = *reinterpret_cast<const DatasetShardHeader*>(data);
+		CHECK(h.magic == DatasetShardHeader::magic_value) << file << " is not a dataset shard";
+		CHECK(h.version == DatasetShardHeader::current_version) << file << " has version " << h.version;
+		CHECK(h.has_same_layout(DatasetShardHeader::of<G>())) << file << " was written with a different geometry";
+
+		const size_t count = (size - sizeof(DatasetShardHeader)) / sizeof(Record);
+		if (count * sizeof(Record) + sizeof(DatasetShardHeader) != size)
+		{
+			LOG(WARNING) << file << " ends in a partial record, ignored";
+		}
+		shards.push_back({file,data,size,reinterpret_cast<const Record*>(data + sizeof(DatasetShardHeader)),count});
+	}
+};
+
+// streams the shards in a new random order every pass, each front to back so reads stay sequential,
+// through a shuffle buffer : a draw takes a random resident record and the stream refills its slot.
+template <typename G>
+class ShuffleBuffer
+{
+public :
+	typedef DatasetRecord<G> Record;
+
+	ShuffleBuffer(const DatasetShards<G>& dataset, const RandomStream& random)
+	: dataset(dataset), random(random), pass(0), shard(0), position(0)
+	{
+		CHECK_GT(FLAGS_shuffle_buffer,0);
+		for (int i=0; i<dataset.shards.size(); ++i)
+		{
+			if (dataset.shards[i].count > 0) order.push_back(i);
+		}
+		start_pass();
+
+		const size_t size = std::min<size_t>(FLAGS_shuffle_buffer,dataset.count());
+		buffer.reserve(size);
+		while (buffer.size() < size)
+		{
+			buffer.push_back(stream());
+		}
+	}
+
+	template <size_t N>
+	void draw(std::array<const Record*,N>& out)
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		for (auto& r : out)
+		{
+			auto& slot = buffer[random.randint(buffer.size())];
+			r = slot;
+			slot = stream();
+		}
+	}
+
+	int passes() const
+	{
+		return pass;
+	}
+
+private:
+	const Record* stream()
+	{
+		const auto& s = dataset.shards[order[shard]];
+		const Record* r = &s.records[position];
+		if (++position == s.count)
+		{
+			position = 0;
+			if (++shard == order.size())
+			{
+				pass++;
+				start_pass();
+			}
+		}
+		return r;
+	}
+
+	void start_pass()
+	{
+		shard = 0;
+		std::shuffle(order.begin(),order.end(),random);
+	}
+
+	const DatasetShards<G>& dataset;
+	RandomStream random;
+	std::mutex mutex;
+	std::vector<const Record*> buffer;
+	std::vector<int> order;
+	std::atomic<int> pass;
+	int shard;
+	size_t position;
+};
+
+// decoder_threads threads draw minibatches of records from the shuffle buffer and turn them back into experiences,
+// whose frames are RasterFrames holding what the network was fed. finished minibatches queue up for the trainer.
+template <typename G>
+class DatasetFeed
+{
+public :
+	typedef ::Experience<G> Experience;
+	typedef DatasetRecord<G> Record;
+	typedef std::array<Experience,G::MinibatchSize> Minibatch;
+	typedef std::unique_ptr<Minibatch> MinibatchPtr;
+
+	DatasetFeed(const std::string& dir, const RandomStream& random)
+	: dataset(dir), shuffle(dataset,random), stopping(false)
+	{
+		CHECK_GT(FLAGS_decoder_threads,0);
+		for (int i=0; i<FLAGS_decoder_threads; ++i)
+		{
+			decoders.push_back(std::thread([this]{ decode(); }));
+		}
+	}
+
+	~DatasetFeed()
+	{
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			stopping = true;
+		}
+		not_full.notify_all();
+		for (auto& t : decoders)
+		{
+			t.join();
+		}
+	}
+
+	// blocks until a decoder has a minibatch ready
+	MinibatchPtr next()
+	{
+		PROFILE_SCOPE(train_dataset_wait);
+
+		std::unique_lock<std::mutex> lock(mutex);
+		not_empty.wait(lock,[this]{ return !ready.empty(); });
+		auto batch = std::move(ready.front());
+		ready.pop_front();
+		not_full.notify_one();
+		return batch;
+	}
+
+	int passes() const
+	{
+		return shuffle.passes();
+	}
+
+	const DatasetShards<G> dataset;
+
+private:
+	enum { queue_per_decoder = 2 };
+
+	void decode()
+	{
+		std::array<const Record*,G::MinibatchSize> records;
+		for (;;)
+		{
+			shuffle.draw(records);
+
+			MinibatchPtr batch(new Minibatch);
+			for (int k=0; k<G::MinibatchSize; ++k)
+			{
+				decode(*records[k],(*batch)[k]);
+			}
+
+			std::unique_lock<std::mutex> lock(mutex);
+			not_full.wait(lock,[this]{ return stopping || ready.size() < FLAGS_decoder_threads * queue_per_decoder; });
+			if (stopping) return;
+			ready.push_back(std::move(batch));
+			not_empty.notify_one();
+		}
+	}
+
+	static void decode(const Record& r, Experience& e)
+	{
+		for (int i=0; i<Record::num_frames; ++i)
+		{
+			SingleFrameSp<G> frame;
+			if (r.has_frame(i))
+			{
+				auto raster = new RasterFrame<G>;
+				for (int c=0; c<channels; ++c)
+				{
+					std::copy(r.images[i] + c * G::sight_area,r.images[i] + (c + 1) * G::sight_area,raster->images[c].begin());
+				}
+				std::copy(r.stats[i],r.stats[i] + num_stats,raster->stats.begin());
+				frame.reset(raster);
+			}
+			(i < G::window_length ? e.input_frames[i] : e.next_frame) = frame;
+		}
+		e.action = r.action;
+		e.reward = r.reward;
+		e.check_sanity();
+	}
+
+	ShuffleBuffer<G> shuffle;
+	std::vector<std::thread> decoders;
+	std::mutex mutex;
+	std::condition_variable not_empty, not_full;
+	std::deque<MinibatchPtr> ready;
+	bool stopping;
+};
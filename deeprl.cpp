@@ -17,13 +17,27 @@ DEFINE_bool(gpu, false, "Use GPU to brew Caffe");
 DEFINE_string(solver, "dqn_solver.prototxt",  "The solver definition protocol buffer text file.");
 DEFINE_string(model, "", "trained model filename");
 DEFINE_string(model2, "", "trained model filename");
+DEFINE_string(export_flat, "", "write the loaded model as a flat mmap-able file and exit");
+DEFINE_int32(seed, -1, "seed for the game and for caffe's weight init; -1 keeps the game's default seed and leaves caffe unseeded");
+DEFINE_int32(benchmark_ticks, 0, "run headless for this many ticks, then report timings and an outcome checksum and exit; needs --seed");
+DEFINE_string(expect_checksum, "", "with --benchmark_ticks, exit non-zero unless the outcome checksum matches");
+DEFINE_string(replay_file, "", "list the episodes recorded in this file with --record_file, or show one with --replay_episode");
+DEFINE_int32(replay_episode, -1, "with --replay_file, the episode to re-simulate and show");
+DEFINE_int32(replay_tick, 0, "with --replay_episode, re-simulate up to this tick without drawing, then show the rest");
+DEFINE_int32(replay_delay_ms, 100, "with --replay_episode, pause between shown ticks");
 
 #include "dqn.h"
 #include "game.h"
+#include "memory_report.h"
+#include "scenario.h"
+#include "league.h"
+#include "evaluation.h"
+#include "recording.h"
 #include <stdio.h>
 #include <termios.h>
 #include <unistd.h>
 #include <fcntl.h>
+#include <thread>
 
 int kbhit(void)
 {
@@ -52,9 +66,12 @@ int kbhit(void)
 	return 0;
 }
 
+// evaluation workers tick worlds too; only the main thread reads the terminal
+const std::thread::id main_thread = std::this_thread::get_id();
+
 bool is_keypressed(char c)
 {
-	if (kbhit())
+	if (FLAGS_benchmark_ticks == 0 && std::this_thread::get_id() == main_thread && kbhit())
 	{
 		auto ch = getchar();
 		if (ch == c)
@@ -64,33 +81,50 @@ bool is_keypressed(char c)
 	return false;
 }
 
-int main(int argc, char** argv) 
+// --train_dataset : sgd steps on recorded experiences as fast as the decoders deliver them; no world is built.
+// the solver snapshots as it would while playing.
+template <typename Network>
+int train_offline(Network& learner, const RandomStream& random)
 {
-	std::mt19937 random_engine;
+	CHECK(learner.solver) << "the learner was loaded for inference only; drop --model2 to train it offline";
 
-	caffe::GlobalInit(&argc,&argv);
-	// google::InstallFailureSignalHandler();
- 	// google::LogToStderr();
+	DatasetFeed<typename Network::Geometry> feed(FLAGS_train_dataset,random.fork(RS_dataset));
 
-	if (FLAGS_gpu)
-	{
-		Caffe::set_mode(Caffe::GPU);
-	}
-	else
+	typedef std::chrono::steady_clock clock;
+	const auto start = clock::now();
+	for (int step=1; step<=FLAGS_offline_steps; ++step)
 	{
-		Caffe::set_mode(Caffe::CPU);
+		auto batch = feed.next();
+		learner.trainer.train(*batch);
+
+		Profiler::tick(step);
+		Metrics::tick();
+
+		if (step % 1000 == 0 || step == FLAGS_offline_steps)
+		{
+			const double seconds = std::chrono::duration<double>(clock::now() - start).count();
+			LOG(INFO) << str(format("offline step %d : loss %.4f, %.0f steps/s, %d passes over the dataset")%step%learner.metrics.loss.get()%(step / seconds)%feed.passes());
+		}
 	}
-	
-	Caffe::set_phase(Caffe::TRAIN);
+
+	Profiler::instance().dump();
+	return 0;
+}
+
+// one run with the networks, frames and brains of geometry G
+template <typename G>
+int run(const RandomStream& random, bool headless)
+{
+	typedef DeepNetwork<G> Network;
 
 	GameState game_state;
 
-	Environment env(random_engine);
+	Environment env(random.fork(RS_learners).fork(0)), env_trained(random.fork(RS_learners).fork(1));
 
 	bool should_swap = false;
 
-	boost::shared_ptr<DeepNetwork> dqn(new DeepNetwork(env,FLAGS_solver));	
-	boost::shared_ptr<DeepNetwork> dqn_trained(new DeepNetwork(env,FLAGS_solver));	
+	boost::shared_ptr<Network> dqn(new Network(env,FLAGS_solver));	
+	boost::shared_ptr<Network> dqn_trained(new Network(env_trained,FLAGS_solver));	
 	if (FLAGS_model != "")
 	{
 		game_state.names[1] = FLAGS_model;
@@ -102,7 +136,7 @@ int main(int argc, char** argv)
 		// dqn_trained = dqn;
 	}
 
-	std::vector<boost::shared_ptr<DeepNetwork>> nets;
+	std::vector<boost::shared_ptr<Network>> nets;
 	if (FLAGS_model2 != "")
 	{
 		game_state.names[0] = FLAGS_model2;
@@ -114,63 +148,93 @@ int main(int argc, char** argv)
 		nets.push_back(dqn);		
 	}		
 
+	if (FLAGS_export_flat != "")
+	{
+		(FLAGS_model != "" ? dqn_trained : dqn)->loader.export_flat(FLAGS_export_flat);
+		return 0;
+	}
+
+	if (FLAGS_target_update_interval > 0)
+	{
+		dqn->trainer.target.reset(new TargetNetwork<Network>(*dqn));
+	}
+
+	if (FLAGS_train_dataset != "")
+	{
+		return train_offline(*dqn,random);
+	}
+
+	if (FLAGS_dataset_dir != "")
+	{
+		dqn->trainer.dataset.reset(new DatasetWriter<G>(FLAGS_dataset_dir));
+	}
+
+	if (FLAGS_learner_replicas > 1)
+	{
+		dqn->trainer.parallel.reset(new DataParallel<Network>(*dqn));
+	}
+
 	nets.push_back(dqn_trained);		
 
+	// the opponent stops learning and plays the learner's past selves instead
+	std::unique_ptr<League<Network>> league;
+	if (FLAGS_league_size > 0)
+	{
+		league.reset(new League<Network>(*dqn,*dqn_trained,random.fork(RS_league)));
+		game_state.names[1] = "league";
+	}
+
+	MemoryReport<Network> memory_report({dqn,dqn_trained});
+
+	int train_steps = 0;
 	auto train_nets = [&]{
 		for (auto n : nets)
 		{
 			if (n->epsilon.is_learning)
 			{
-				n->train();				
+				train_steps += n->train_tick();
 			}
 		}
 	};
 
-	int training_team = 0;
-	bool quit = false;	
-	for (;!quit;game_state.epoch++)
-	{
-		World w(random_engine,game_state);	
-		Display disp(w);		
+	const auto& scenario = find_scenario(FLAGS_scenario);
+	Checksum checksum;
+	double tick_seconds = 0, train_seconds = 0;
+	typedef std::chrono::steady_clock clock;
+	const auto run_start = clock::now();
 
-		auto pos_gen = [&](std::function<Vector()> gen)
-		{
-			for (int trial=0;trial<1000;trial++)
-			{				
-				auto pos = gen();
-				if (w.is_vacant(pos)) return pos;
-			}
+	Metrics::Gauge episode_length("episode_length","ticks in the last finished episode");
+	Metrics::Gauge win_rate("win_rate","moving average of episodes won by the training team");
 
-			LOG(FATAL) << "Couldn't find a valid spawn-point";
-			exit(-1);
-		};
+	EpisodeScheduler episodes(random,game_state,scenario);
 
-		auto x_dist = std::uniform_int_distribution<>(0,w.size.x-1);
+	std::unique_ptr<EpisodeRecorder> recorder;
+	if (FLAGS_record_file != "")
+	{
+		recorder.reset(new EpisodeRecorder(FLAGS_record_file,scenario));
+	}
 
-		auto hero = [&](int team){return static_cast<Agent*>(new Hero(team));};
-		auto hero2 = [&](int team){return static_cast<Agent*>(new Hero2(team));};
-		auto minion = [&](int team){return static_cast<Agent*>(new Minion(team));};
-		auto minion2 = [&](int team){return static_cast<Agent*>(new Minion2(team));};
+	std::unique_ptr<BackgroundEvaluation<Network>> evaluation;
+	if (FLAGS_eval_interval > 0)
+	{
+		evaluation.reset(new BackgroundEvaluation<Network>(random.fork(RS_eval),scenario));
+	}
 
-		auto spawn = [&](int team,std::function<Agent*(int team)> gen){
-			auto pawn = w.spawn([&]{return gen(team);});
-			static_cast<Pawn*>(pawn)->brain.reset(new HeroBrain(team == training_team ? dqn : dqn_trained,&w));
-			pawn->pos = pos_gen([&]{return Vector(x_dist(random_engine),team + w.size.y / 2);});				
-		};			
+	int training_team = 0;
+	bool quit = false;	
+	for (;!quit;game_state.epoch++)
+	{
+		if (league) league->begin_episode(game_state.epoch);
 
-		// spawn(0,minion);
-		// spawn(0,minion);
-		// spawn(0,minion);
-		// spawn(1,minion2);
-		// spawn(1,minion2);
-		spawn(0,hero);
-		spawn(1,hero);		
+		World& w = episodes.next([&](int team){return team == training_team ? dqn : dqn_trained;});
+		std::unique_ptr<Display> disp(headless ? nullptr : new Display(w));
+		if (recorder) recorder->begin(w);
 
 		// should_swap = true;
 
 		while (!w.quit && !quit)
 		{
-			if (kbhit())
+			if (!headless && kbhit())
 			{
 				switch (auto ch = getchar())
 				{
@@ -187,16 +251,173 @@ int main(int argc, char** argv)
 					break;				
 				}
 			}
+			const auto tick_start = clock::now();
 			w.tick();
+			const auto train_start = clock::now();
 			train_nets();
-			disp.tick();
+			const auto train_end = clock::now();
+			tick_seconds += std::chrono::duration<double>(train_start - tick_start).count();
+			train_seconds += std::chrono::duration<double>(train_end - train_start).count();
+
+			if (disp) disp->tick();
+			Profiler::tick(game_state.clock);
+			Tracer::tick(game_state.clock);
+			Metrics::tick();
+			memory_report.tick();
+
+			if (headless)
+			{
+				checksum.add(w);
+				if (game_state.clock >= FLAGS_benchmark_ticks) quit = true;
+			}
 		}	
 
+		if (recorder) recorder->end(w,game_state.epoch);
+
+		if (w.quit)
+		{
+			Metrics::count(MC_episodes);
+			episode_length.set(w.world_clock);
+			win_rate.smooth(w.final_winner == training_team ? 1 : 0,0.01);
+		}
+
+		if (evaluation) evaluation->tick(game_state.epoch + 1,*dqn->net);
+
 		if (should_swap)
 		{
 			training_team = 1-training_team;
 			game_state.swap_team();
 		}		
 	}	
+
+	Profiler::instance().dump();
+	Tracer::finish();
+
+	if (headless)
+	{
+		checksum.add(game_state.scores);
+		for (auto n : nets)
+		{
+			checksum.add(*n->net);
+		}
+
+		const double seconds = std::chrono::duration<double>(clock::now() - run_start).count();
+		const auto result = str(format("%016x")%checksum.value);
+		std::cout << str(format("scenario %s seed %d : %d ticks, %d episodes, %d train steps in %.2f s\n")%scenario.name%FLAGS_seed%game_state.clock%game_state.epoch%train_steps%seconds)
+			<< str(format("  world %.3f ms/tick, train %.3f ms/step\n")%(tick_seconds * 1e3 / game_state.clock)%(train_steps ? train_seconds * 1e3 / train_steps : 0.0));
+
+		// from the profiler, so only with profiling built in
+		const auto histograms = Profiler::instance().merged();
+		const auto& frames = histograms[PP_get_frame];
+		const auto& decisions = histograms[PP_decision];
+		if (frames.total > 0 && decisions.total > 0)
+		{
+			std::cout << str(format("  %d agents, observe %.1f us/frame, %.0f decisions/s\n")%scenario.num_pawns()
+				%(Profiler::instance().ns_per_cycle() / 1000 * frames.sum / frames.total)%(decisions.total / tick_seconds));
+		}
+		std::cout << "checksum " << result << std::endl;
+
+		if (FLAGS_expect_checksum != "" && FLAGS_expect_checksum != result)
+		{
+			LOG(ERROR) << "checksum mismatch : expected " << FLAGS_expect_checksum << ", got " << result;
+			return 1;
+		}
+	}
+	return 0;
+}
+
+// --replay_file : lists the recorded episodes, or re-simulates one, fast-forwarding to --replay_tick, and shows the rest
+int view_replay()
+{
+	EpisodeLog log(FLAGS_replay_file);
+	if (FLAGS_replay_episode < 0)
+	{
+		for (int i=0; i<log.entries.size(); ++i)
+		{
+			const auto& h = log.entries[i].header;
+			std::cout << str(format("%5d : epoch %6d %-10s %5d ticks, winner %2d, %6d bytes\n")%i%h.epoch%h.scenario%h.ticks%h.final_winner%(sizeof(h) + h.compressed_size));
+		}
+		return 0;
+	}
+
+	CHECK_LT(FLAGS_replay_episode,log.entries.size()) << FLAGS_replay_file << " holds " << log.entries.size() << " episodes";
+	EpisodeReplay replay(log.entries[FLAGS_replay_episode].header,log.tape(FLAGS_replay_episode));
+
+	typedef std::chrono::steady_clock clock;
+	const auto seek_start = clock::now();
+	replay.seek(FLAGS_replay_tick);
+	LOG(INFO) << str(format("re-simulated %d ticks in %.2f ms")%replay.world.world_clock%(std::chrono::duration<double>(clock::now() - seek_start).count() * 1e3));
+
+	Display disp(replay.world);
+	bool quit = false;
+	do
+	{
+		disp.dump();
+		std::this_thread::sleep_for(std::chrono::milliseconds(FLAGS_replay_delay_ms));
+		quit = kbhit() && getchar() == 27;
+	} while (!quit && replay.step());
+
+	if (!quit && !replay.matches_record())
+	{
+		LOG(ERROR) << "replay diverged from the recording : ended at tick " << replay.world.world_clock << " won by " << replay.world.final_winner
+			<< ", recorded " << replay.header.ticks << " won by " << replay.header.final_winner;
+		return 1;
+	}
 	return 0;
+}
+
+// with_geometry's callback : runs the geometry --geometry named
+struct Run
+{
+	const RandomStream& random;
+	bool headless;
+
+	template <typename G>
+	int operator()(G) const
+	{
+		return run<G>(random,headless);
+	}
+};
+
+int main(int argc, char** argv) 
+{
+	caffe::GlobalInit(&argc,&argv);
+	CHECK(Philox4x32::passes_known_answers()) << "philox4x32-10 doesn't reproduce its known-answer vectors";
+
+	// replays run no networks
+	if (FLAGS_replay_file != "")
+	{
+		return view_replay();
+	}
+
+	// the benchmark never reads the terminal and draws nothing, so a seed fixes the whole run
+	const bool headless = FLAGS_benchmark_ticks > 0;
+	if (headless)
+	{
+		CHECK_GE(FLAGS_seed,0) << "--benchmark_ticks needs --seed";
+	}
+
+	// learner replicas already spread the gemms over cores; blas threads on top would only oversubscribe them
+	set_blas_threads(FLAGS_blas_threads == 0 && FLAGS_learner_replicas > 1 ? 1 : FLAGS_blas_threads);
+
+	const RandomStream random(FLAGS_seed < 0 ? 0 : FLAGS_seed);
+	if (FLAGS_seed >= 0)
+	{
+		Caffe::set_random_seed(FLAGS_seed);
+	}
+	// google::InstallFailureSignalHandler();
+ 	// google::LogToStderr();
+
+	if (FLAGS_gpu)
+	{
+		Caffe::set_mode(Caffe::GPU);
+	}
+	else
+	{
+		Caffe::set_mode(Caffe::CPU);
+	}
+	
+	Caffe::set_phase(Caffe::TRAIN);
+
+	return with_geometry(FLAGS_geometry,Run{random,headless});
 }
\ No newline at end of file
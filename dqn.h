@@ -1,3 +1,4 @@
+#include "random.h"
 #include "environment.h"
 #include "config.h"
 #include "single_frame.h"
@@ -6,6 +7,15 @@
 #include <fstream>
 #include <streambuf>
 #include <unordered_map>
+#include <bitset>
+#include <deque>
+#ifdef __SSE__
+#include <xmmintrin.h>
+#endif
+#include "flat_model.h"
+#include "profiler.h"
+#include "metrics.h"
+#include "masked_q_loss.h"
 
 DEFINE_int32(experience_size, 10, "experience_size percent");
 DEFINE_int32(learning_steps_total, 1000000, "learning_steps_total");
@@ -13,30 +23,88 @@ DEFINE_int32(learning_steps_burnin, -1, "learning_steps_burnin");
 DEFINE_int32(epsilon_min, 0.1, "epsilon_min");
 DEFINE_int32(epsilon_test, 0.05, "epsilon_test");
 DEFINE_double(gamma, 0.95, "gamma");
+DEFINE_bool(lazy_frames, false, "keep compact world snapshots in replay and rasterize observations when they are sampled");
+DEFINE_int32(action_repeat, 1, "ticks each chosen action is repeated for; only decision ticks are observed and stored");
+DEFINE_int32(blas_threads, 0, "threads caffe's blas may use; 0 keeps the library default");
+DEFINE_double(train_ratio, 1.0, "sgd steps per world tick, may be fractional");
 DEFINE_int32(display_interval, 5, "display_interval");
 DEFINE_int32(display_after, 10000, "display_after");
 
 typedef std::array<float,num_actions> net_input_type;
-typedef boost::shared_ptr<SingleFrame> SingleFrameSp;
-typedef std::array<SingleFrameSp,window_length> InputFrames;
+template <typename G> using SingleFrameSp = boost::shared_ptr<SingleFrame<G>>;
+template <typename G> using InputFrames = std::array<SingleFrameSp<G>,G::window_length>;
+typedef std::bitset<num_actions> ActionMask;
+
+// whichever blas caffe was linked against; weak so neither library is required
+extern "C" void openblas_set_num_threads(int) __attribute__((weak));
+extern "C" void mkl_set_num_threads(int) __attribute__((weak));
+
+void set_blas_threads(int n)
+{
+	if (n <= 0) return;
+
+	if (openblas_set_num_threads) 
+	{
+		openblas_set_num_threads(n);
+	}
+	else if (mkl_set_num_threads) 
+	{
+		mkl_set_num_threads(n);
+	}
+	else
+	{
+		LOG(WARNING) << "blas_threads ignored : the linked blas has no thread control";
+	}
+}
+
+// newer openblas and mkl can also set them for the calling thread alone
+extern "C" int openblas_set_num_threads_local(int) __attribute__((weak));
+extern "C" int mkl_set_num_threads_local(int) __attribute__((weak));
+
+// blas threads for the calling thread's own calls; false when the linked blas only has the process-wide setting
+bool set_thread_blas_threads(int n)
+{
+	if (mkl_set_num_threads_local) 
+	{
+		mkl_set_num_threads_local(n);
+		return true;
+	}
+	if (openblas_set_num_threads_local) 
+	{
+		openblas_set_num_threads_local(n);
+		return true;
+	}
+	return false;
+}
 
 bool is_valid_action(int action) { return action >= 0 && action < num_actions; }
 bool is_valid_reward(float reward) { return reward >= -1.0 && reward <= 1.0; }
 bool is_valid_epsilon(float eps) { return eps >= 0.0 && eps <= 1.0; }
 bool is_valid_q(float val) { return !std::isnan(val); }
 
+template <typename G>
 struct Experience
 {
-	InputFrames input_frames;
+	InputFrames<G> input_frames;
 	int action;
 	float reward;
-	SingleFrameSp next_frame;	
+	SingleFrameSp<G> next_frame;	
 
 	void check_sanity() const
 	{
 		assert(is_valid_reward(reward));
 		assert(is_valid_action(action));
 	}
+
+	// the window shifted by one onto next_frame : the state the action led to
+	void next_window(InputFrames<G>& out) const
+	{
+		for (int j=0; j<G::temporal_window; ++j)
+		{
+			out[j] = input_frames[j+1];
+		}
+		out[G::temporal_window] = next_frame;
+	}
 };
 
 struct Policy
@@ -68,6 +136,40 @@ struct Policy
 	}
 };
 
+// first action holding the largest q among the masked ones; like the scalar scan it started from,
+// values not above FLT_MIN don't count and yield an invalid policy.
+Policy masked_argmax(const float* q, const ActionMask& mask)
+{
+	enum { lanes = 4, padded_actions = (num_actions + lanes - 1) / lanes * lanes };
+
+	alignas(16) float masked[padded_actions];
+	for (int action=0; action<padded_actions; ++action)
+	{
+		masked[action] = action < num_actions && mask[action] ? q[action] : -FLT_MAX;
+		assert(action >= num_actions || is_valid_q(q[action]));
+	}
+
+#ifdef __SSE__
+	__m128 best = _mm_load_ps(masked);
+	for (int i=lanes; i<padded_actions; i+=lanes)
+	{
+		best = _mm_max_ps(best,_mm_load_ps(masked + i));
+	}
+	best = _mm_max_ps(best,_mm_shuffle_ps(best,best,_MM_SHUFFLE(2,3,0,1)));
+	best = _mm_max_ps(best,_mm_shuffle_ps(best,best,_MM_SHUFFLE(1,0,3,2)));
+	const float best_val = _mm_cvtss_f32(best);
+#else
+	const float best_val = *std::max_element(masked,masked + padded_actions);
+#endif
+
+	if (!(best_val > FLT_MIN))
+	{
+		return Policy(nullptr);
+	}
+
+	return Policy(std::find(masked,masked + num_actions,best_val) - masked,best_val);
+}
+
 class AnnealedEpsilon
 {
 public:
@@ -106,18 +208,79 @@ public:
 	}
 };
 
+// a net's parameters flattened into one buffer and back, for weight copies that touch neither disk nor a solver
+std::vector<float> freeze_params(caffe::Net<float>& net)
+{
+	std::vector<float> params;
+	for (const auto& p : net.params())
+	{
+		params.insert(params.end(),p->cpu_data(),p->cpu_data() + p->count());
+	}
+	return params;
+}
+
+void thaw_params(const std::vector<float>& params, caffe::Net<float>& net)
+{
+	auto src = params.data();
+	for (const auto& p : net.params())
+	{
+		CHECK_LE(src + p->count(),params.data() + params.size()) << "frozen parameters don't fit the net";
+		caffe::caffe_copy(p->count(),src,p->mutable_cpu_data());
+		src += p->count();
+	}
+	CHECK_EQ(src,params.data() + params.size()) << "frozen parameters don't fit the net";
+}
+
+// points into's parameter blobs at from's memory, so both nets read whatever from was last updated to
+void share_params(caffe::Net<float>& from, caffe::Net<float>& into)
+{
+	const auto& src = from.params();
+	const auto& dst = into.params();
+	CHECK_EQ(src.size(),dst.size());
+	for (int i=0; i<src.size(); ++i)
+	{
+		CHECK_EQ(src[i]->count(),dst[i]->count());
+		dst[i]->ShareData(*src[i]);
+	}
+}
+
+// a network that only forwards : greedy but for epsilon_test, without a solver, loaded from model when one is given
+template <typename Network>
+boost::shared_ptr<Network> inference_network(Environment& env, const std::string& model = "")
+{
+	boost::shared_ptr<Network> n(new Network(env,FLAGS_solver));
+	if (model != "")
+	{
+		n->loader.load_trained(model);
+	}
+	n->epsilon.is_learning = false;
+	n->solver.reset();
+	return n;
+}
+
+#include "dataset.h"
+
+template <typename Network> class DataParallel;
+template <typename Network> class TargetNetwork;
+
+// everything sized by the geometry : minibatch buffers, input blobs and the frames it is fed
+template <typename G>
 class DeepNetwork
 {
 public :
+	typedef G Geometry;
+	typedef ::SingleFrameSp<G> SingleFrameSp;
+	typedef ::InputFrames<G> InputFrames;
+	typedef ::Experience<G> Experience;
+
+	enum { temporal_window = G::temporal_window, sight_diameter = G::sight_diameter, MinibatchSize = G::MinibatchSize };
+	enum { ImageSize = G::ImageSize, ImageChannels = G::ImageChannels, StatChannels = G::StatChannels, InputDataSize = G::InputDataSize };
+
 	Environment& env;
 
 	typedef std::array<float,MinibatchSize * InputDataSize> FramesLayerInputData;
 	typedef std::array<float,MinibatchSize * StatChannels> StatsLayerInputData;
-	typedef std::array<float,MinibatchSize * OutputCount> TargetLayerInputData;
-	typedef std::array<float,MinibatchSize * OutputCount> FilterLayerInputData;
-
-	typedef std::function<bool(int)> IsValidActionFunctionType;
-	typedef std::function<int()> RandomActionFunctionType;
+	typedef std::array<MaskedQLoss::ActionTarget,MinibatchSize> ActionTargetData;
 
 	typedef shared_ptr<caffe::Blob<float>> BlobSp;
 	typedef shared_ptr<caffe::Net<float>> NetSp;
@@ -129,9 +292,10 @@ public :
 		DeepNetwork& net;
 
 		ReplayMemory(DeepNetwork& net)
-		: size(std::max(0,std::min(100,FLAGS_experience_size)) * FLAGS_learning_steps_total / 100), net(net)
+		: size(std::max(0,std::min(100,FLAGS_experience_size)) * FLAGS_learning_steps_total / 100), net(net), written(nullptr)
 		{
 			experiences.reserve(size);
+			stamps.reserve(size);
 		}
 
 		bool has_enough_samples( size_t num_experiences ) const
@@ -139,31 +303,92 @@ public :
 			return experiences.size() >= num_experiences;
 		}
 
+		size_t count() const
+		{
+			return experiences.size();
+		}
+
+		// the slots only; frames are shared between experiences and accounted by SingleFrame
+		size_t bytes() const
+		{
+			return experiences.capacity() * (sizeof(Experience) + sizeof(uint32_t));
+		}
+
+		// the slot e lives in, -1 if it isn't one of ours
+		int index_of(const Experience* e) const
+		{
+			const auto i = e - experiences.data();
+			return i >= 0 && i < experiences.size() ? i : -1;
+		}
+
+		const Experience& at(int index) const
+		{
+			return experiences[index];
+		}
+
+		// bumped whenever the slot is overwritten
+		uint32_t stamp(int index) const
+		{
+			return stamps[index];
+		}
+
+		// held by push; a reader on another thread (the target cache) holds it while it copies slots
+		std::mutex mutex;
+
+		// when set, push appends every slot it writes; drained by whoever set it, under mutex
+		std::deque<int>* written;
+
 		const Experience& get_random() const
 		{
 			return experiences[ net.env.randint(experiences.size()) ];
 		}
 
+		// a whole minibatch of indices in one batched draw
+		template <size_t N>
+		void get_random(std::array<const Experience*,N>& out) const
+		{
+			std::array<int,N> indices;
+			net.env.random.fill_randint(indices.data(),N,experiences.size());
+			for (int k=0; k<N; ++k)
+			{
+				out[k] = &experiences[indices[k]];
+			}
+		}
+
 		void push(const Experience& e)
 		{
 			Experience* out;
 
 			e.check_sanity();
 
+			std::lock_guard<std::mutex> lock(mutex);
+
 			// being slow for limited time frames
+			int index;
 			if (experiences.size() < size)
 			{
+				index = experiences.size();
 				experiences.push_back(e);				
+				stamps.push_back(0);
 			}
 			else
 			{
-				experiences[net.env.randint(size)] = e;
+				index = net.env.randint(size);
+				experiences[index] = e;
+				stamps[index]++;
+				Metrics::count(MC_replay_evictions);
+			}
+
+			if (written)
+			{
+				written->push_back(index);
 			}
 		}
 
 	private:
 		int size;
 		std::vector<Experience> experiences; // reserved, no fragmentation
+		std::vector<uint32_t> stamps;
 	};
 
 	class Feeder
@@ -175,36 +400,28 @@ public :
 
 		MemoryDataLayerSp frames_input_layer;
 		MemoryDataLayerSp stats_input_layer;
-		MemoryDataLayerSp target_input_layer;
-		MemoryDataLayerSp filter_input_layer;
-		TargetLayerInputData dummy_input_data;
+		std::array<float,MinibatchSize> dummy_input_data;
 
 		class Cursor
 		{
 		public:
 			FramesLayerInputData frames_input;
 			StatsLayerInputData stats_input;
-	  		TargetLayerInputData target_input;	  		
-	  		FilterLayerInputData filter_input;
+	  		ActionTargetData action_targets; // read by MaskedQLoss, not fed to the net
 	  		Feeder& feeder;
 
 			Cursor(Feeder& feeder) : feeder(feeder)
 			{}
 
-			FramesLayerInputData::iterator frames;
-			StatsLayerInputData::iterator stats;
-			TargetLayerInputData::iterator target;
-			FilterLayerInputData::iterator filter;
+			typename FramesLayerInputData::iterator frames;
+			typename StatsLayerInputData::iterator stats;
+			typename ActionTargetData::iterator action_target;
 
 			void begin()
 			{
 				frames = frames_input.begin();
 				stats = stats_input.begin();
-				target = target_input.begin();
-				filter = filter_input.begin();
-
-				std::fill(target_input.begin(),target_input.end(),0);
-				std::fill(filter_input.begin(),filter_input.end(),0);
+				action_target = action_targets.begin();
 			}
 
 			template <typename U>
@@ -217,36 +434,27 @@ public :
 					auto frame = f.get();
 					if (frame)
 					{
-						for (const auto& image : frame->images)
-						{
-							std::copy(image.begin(),image.end(),target);
-							assert(image.size() == sight_area);
-							target += sight_area;
-						}						
-
-						std::copy(frame->stats.begin(), frame->stats.end(), target_stats);
+						frame->write(&*target,&*target_stats);
 					}
 					else
 					{
 						std::fill(target, target + ImageSize,0);
-						target += ImageSize;
 					}										
+					target += ImageSize;
 					target_stats += num_stats;
 				}
 			}
 
 			void write_target(int action, float r)
 			{
-				target[action] = r;
-				filter[action] = 1.0f;
+				*action_target = {action,r};
 			}
 
 			void advance()
 			{
 				frames += InputDataSize;
 				stats += StatChannels;
-				target += OutputCount;
-				filter += OutputCount;
+				++action_target;
 			}
 
 			void done()
@@ -254,7 +462,7 @@ public :
 				std::fill(frames, frames_input.end(), 0);
 				std::fill(stats, stats_input.end(), 0);
 				
-				feeder.input(frames_input,stats_input,target_input,filter_input);
+				feeder.input(frames_input,stats_input);
 			}
 		};		
 
@@ -272,12 +480,10 @@ public :
 			std::fill(dummy_input_data.begin(),dummy_input_data.end(),0.0);
 		}
 
-		void input( const FramesLayerInputData& frames, const StatsLayerInputData& stats, const TargetLayerInputData& target, const FilterLayerInputData& filter )
+		void input( const FramesLayerInputData& frames, const StatsLayerInputData& stats )
 		{
 			frames_input_layer->Reset(const_cast<float*>(frames.data()),dummy_input_data.data(),MinibatchSize);						
 			stats_input_layer->Reset(const_cast<float*>(stats.data()),dummy_input_data.data(),MinibatchSize);
-			target_input_layer->Reset(const_cast<float*>(target.data()),dummy_input_data.data(),MinibatchSize);
-			filter_input_layer->Reset(const_cast<float*>(filter.data()),dummy_input_data.data(),MinibatchSize);
 		}		
 
 		void forward()
@@ -295,8 +501,6 @@ public :
 
 			frames_input_layer = get_layer("frames_input_layer");		
 			stats_input_layer = get_layer("stats_input_layer");		
-			target_input_layer = get_layer("target_input_layer");
-			filter_input_layer = get_layer("filter_input_layer");
 		}
 
 		void check_sanity()
@@ -312,8 +516,7 @@ public :
 
 			check_blob_size("frames",MinibatchSize,ImageChannels,sight_diameter,sight_diameter);
 			check_blob_size("stats",MinibatchSize,StatChannels,1,1);
-			check_blob_size("target",MinibatchSize,num_actions,1,1);
-			check_blob_size("filter",MinibatchSize,num_actions,1,1);
+			check_blob_size("q_values",MinibatchSize,num_actions,1,1);
 		}
 	};
 
@@ -325,7 +528,7 @@ public :
 
 		DeepNetwork& net;
 		BlobSp q_values_blob;
-		Feeder::Cursor cursor;
+		typename Feeder::Cursor cursor;
 
 		Evaluator(DeepNetwork& net) : net(net), cursor(net.feeder)
 		{
@@ -338,7 +541,7 @@ public :
 		}
 
 		std::array<Policy,N> policies;
-		std::array<Policy,N>& evaluate(const std::array<InputFrames,N>& input_frames_batch,IsValidActionFunctionType is_valid_action)
+		std::array<Policy,N>& evaluate(const std::array<InputFrames,N>& input_frames_batch,const ActionMask& mask)
 		{			
 			cursor.begin();
 			for (const auto& input_frames : input_frames_batch)
@@ -351,35 +554,12 @@ public :
 	  
 			net.feeder.forward();
 
-			int index = 0;
-			std::generate(policies.begin(), policies.end(), [&](){ return get_policy(index++,is_valid_action); });
-			return policies;
-		}
-
-		Policy get_policy(int index, IsValidActionFunctionType is_valid_action)
-		{
-			auto q_at = [&](int action){
-				auto q = q_values_blob->data_at(index,action,0,0);
-				assert(is_valid_q(q));
-				return q;
-			};
-
-			Policy best(nullptr);
-			
-			for (int action=0; action<num_actions; ++action)
+			const float* q_values = q_values_blob->cpu_data();
+			for (int index=0; index<N; ++index)
 			{
-				if (is_valid_action(action))
-				{
-					auto q = q_at(action);
-					if (q > best.val)
-					{
-						best = Policy(action,q);
-					}				
-				}				
-			}	
-			
-			// std::cout << str(format("%d:%.2f")%best.action%best.val) << "\n";
-			return best;
+				policies[index] = masked_argmax(q_values + q_values_blob->offset(index),mask);
+			}
+			return policies;
 		}
 	};
 
@@ -389,14 +569,18 @@ public :
 		DeepNetwork& net;		
 		float gamma;		
 
-		Feeder::Cursor cursor;
+		typename Feeder::Cursor cursor;
 
   		ReplayMemory replay_memory;	
 
   		std::array<const Experience*,MinibatchSize> samples;
 		std::array<InputFrames,MinibatchSize> input_frames_batch;
 
-		BlobSp loss_blob;
+		BlobSp q_values_blob;
+
+		std::unique_ptr<DatasetWriter<G>> dataset; // null unless the learner's experiences are kept for offline training
+		std::unique_ptr<DataParallel<DeepNetwork>> parallel; // null unless --learner_replicas spreads the steps over cores
+		std::unique_ptr<TargetNetwork<DeepNetwork>> target; // null while next states are valued by this network itself
 
 		Trainer(DeepNetwork& net) : net(net), gamma(FLAGS_gamma), replay_memory(net), cursor(net.feeder)
 		{
@@ -405,7 +589,7 @@ public :
 
 		void init()
 		{
-			loss_blob = net.net->blob_by_name("loss");
+			q_values_blob = net.net->blob_by_name("q_values");
 		}
 
 		void push(const Experience& e)
@@ -413,33 +597,107 @@ public :
 			++net.epsilon;
 			
 			replay_memory.push(e);
+			if (dataset) dataset->append(e);
+
+			net.metrics.epsilon.set(net.epsilon.get());
+			net.metrics.replay_size.set(replay_memory.count());
 		}
 
-		void train()
+		// false while replay memory is still burning in
+		bool train()
 		{				
 			if (!replay_memory.has_enough_samples(net.epsilon.learning_steps_burnin))
 			{
-				return;
+				return false;
 			}		
 		
+			if (parallel)
+			{
+				parallel->step();
+			}
+			else
+			{
+				sample();
+				step();
+			}
+			if (target) target->tick();
+			return true;
+		}
+
+		// one sgd step on a minibatch from elsewhere than replay memory, such as an offline dataset
+		void train(const std::array<Experience,MinibatchSize>& batch)
+		{
 			for (int k=0; k<MinibatchSize; ++k)
 			{
-				const auto& e = replay_memory.get_random();
-				e.check_sanity();
+				samples[k] = &batch[k];
+			}
+			step();
+			if (target) target->tick();
+		}
+
+		// the update for the minibatch in samples
+		void step()
+		{
+			const float loss = compute_gradients(evaluate_next_states());
+			{
+				PROFILE_SCOPE(train_update);
+				ExternalLossSolver::of(*net.solver).ApplyUpdate(loss);
+			}
+
+			Metrics::count(MC_sgd_steps);
+			net.metrics.loss.smooth(loss,0.01);
+		}
+
+		// the loss of the minibatch in samples given its next states' values, its gradients left in the parameters' diffs
+		float compute_gradients(const std::array<Policy,MinibatchSize>& next_values)
+		{
+			gather(next_values);
 
-				samples[k] = &e;
+			PROFILE_SCOPE(train_solver_step);
+			net.feeder.forward();
+			const float loss = MaskedQLoss::compute(*q_values_blob,cursor.action_targets,FLAGS_huber_delta);
+			net.net->Backward();
+			return loss;
+		}
+
+		void sample()
+		{
+			PROFILE_SCOPE(train_sample);
+
+			replay_memory.get_random(samples);
+		}
+
+		// each sample's window shifted by one onto its next frame, for the target forward
+		void collect_next_states()
+		{
+			for (int k=0; k<MinibatchSize; ++k)
+			{
+				const auto& e = *samples[k];
+				e.check_sanity();
 
 				if (e.next_frame) 
 				{
-					for (int j=0; j<temporal_window; ++j)
-					{
-						input_frames_batch[k][j] = e.input_frames[j+1];						
-					}				
-					input_frames_batch[k][temporal_window] = e.next_frame;
+					e.next_window(input_frames_batch[k]);
 				}	
 			}
+		}
+
+		const std::array<Policy,MinibatchSize>& evaluate_next_states()
+		{
+			PROFILE_SCOPE(train_target_forward);
+
+			if (target)
+			{
+				return target->evaluate(samples);
+			}
+
+			collect_next_states();
+			return net.eval_for_train.evaluate(input_frames_batch,ActionMask().set());
+		}
 
-			const auto& policies = net.eval_for_train.evaluate(input_frames_batch,[=](int action){return true;});
+		void gather(const std::array<Policy,MinibatchSize>& policies)
+		{
+			PROFILE_SCOPE(train_gather);
 
 			cursor.begin();
 			
@@ -460,8 +718,6 @@ public :
 			}
 
 			cursor.done();
-
-			net.solver->Step(1);			
 		}
 	};
 
@@ -502,18 +758,33 @@ public :
 				LOG(FATAL) << "Unknown Caffe mode: " << Caffe::mode();
 			}
 			
-			net.solver.reset(caffe::GetSolver<float>(param));
+			net.solver.reset(ExternalLossSolver::create(param));
 			net.net = net.solver->net();
 		}
 
 		void load_trained(const std::string& model_bin)
 		{
-			net.net->CopyTrainedLayersFrom(model_bin);
+			if (FlatModel::is_flat(model_bin))
+			{
+				flat_model.reset(new FlatModel::Mapping(model_bin,FlatModelHeader::of<G>()));
+				flat_model->bind(*net.net);
+			}
+			else
+			{
+				net.net->CopyTrainedLayersFrom(model_bin);
+			}
 			net.epsilon.is_learning = false;
 			net.solver.reset();
 		}
 
+		void export_flat(const std::string& file)
+		{
+			FlatModel::write(file,*net.net,FlatModelHeader::of<G>());
+		}
+
 	private:
+		boost::shared_ptr<FlatModel::Mapping> flat_model;
+
 		void replace_proto(std::string& proto)
 		{
 			std::unordered_map<std::string, std::string> dictionary;
@@ -566,6 +837,25 @@ public :
 		}
 	}	
 
+	struct NetworkMetrics
+	{
+		NetworkMetrics(const std::string& labels)
+		: epsilon("epsilon","exploration rate",labels), 
+		  replay_size("replay_size","experiences held in replay memory",labels), 
+		  loss("loss_avg","moving average of the training loss",labels), 
+		  mean_q("mean_q","moving average of the greedy action's q value",labels)
+		{}
+
+		Metrics::Gauge epsilon, replay_size, loss, mean_q;
+	};
+
+	static int next_id()
+	{
+		static int id = 0;
+		return id++;
+	}
+
+	NetworkMetrics metrics;
 	AnnealedEpsilon epsilon;		
 	NetSp net;
 	SolverSp solver;	
@@ -575,22 +865,27 @@ public :
 	Evaluator<1> eval_for_prediction;
 	Evaluator<MinibatchSize> eval_for_train;
 	Trainer trainer;
+	float train_credit;
 	
 	DeepNetwork(Environment& env,std::string file)
-	: env(env), loader(*this,file), epsilon(env), trainer(*this), eval_for_prediction(*this), eval_for_train(*this), feeder(*this)
+	: env(env), metrics(str(format("net=\"%d\"")%next_id())), loader(*this,file), epsilon(env), trainer(*this), eval_for_prediction(*this), eval_for_train(*this), feeder(*this), train_credit(0)
 	{}		
 
-	Policy predict(const InputFrames& input_frames,RandomActionFunctionType random_action,IsValidActionFunctionType is_valid_action)
+	template <typename RandomAction>
+	Policy predict(const InputFrames& input_frames,const ActionMask& mask,const RandomAction& random_action)
 	{	
+		PROFILE_SCOPE(predict);
+
 		if (epsilon.should_do_random_action())
 		{
 			return Policy(random_action());
 		}
 		else
 		{
-			Policy p = eval_for_prediction.evaluate(std::array<InputFrames,1>{{input_frames}},is_valid_action).front();
+			Policy p = eval_for_prediction.evaluate(std::array<InputFrames,1>{{input_frames}},mask).front();
 			if (p.is_valid())
 			{
+				metrics.mean_q.smooth(p.val,0.01);
 				return p;
 			}
 			else
@@ -600,10 +895,23 @@ public :
 		}
 	}		
 
-	void train()
+	bool train()
 	{
-		trainer.train();		
+		return trainer.train();		
 	}	
+
+	// called once per world tick; runs train_ratio sgd steps on average and returns how many ran
+	int train_tick()
+	{
+		int steps = 0;
+		for (train_credit += FLAGS_train_ratio; train_credit >= 1; train_credit -= 1)
+		{
+			if (train()) steps++;
+		}
+		return steps;
+	}
 };
 
+#include "data_parallel.h"
+#include "target_network.h"
 #include "brain.h"
\ No newline at end of file
@@ -1,19 +1,19 @@
 struct Environment
 {
-	Environment(std::mt19937& random_engine)
-	: random_engine(random_engine)
+	// one learner's stream; each network gets its own so learners never contend for draws
+	Environment(const RandomStream& random)
+	: random(random)
 	{}
 
-	std::mt19937& random_engine;
+	RandomStream random;
 
 	bool test_prob(float prob)
 	{
-		const float dice = std::uniform_real_distribution<float>(0,1)(random_engine);		
-		return dice < prob;
+		return random.test_prob(prob);
 	}
 
 	int randint(int N)
 	{
-		return std::uniform_int_distribution<>(0,N-1)(random_engine);
+		return random.randint(N);
 	}
 };
\ No newline at end of file
@@ -0,0 +1,196 @@
+#include <pthread.h>
+#include <thread>
+#include <sstream>
+
+DEFINE_int32(eval_interval, 0, "episodes between background evaluations of the learner; 0 disables");
+DEFINE_int32(eval_games, 20, "greedy games against each baseline per evaluation");
+DEFINE_int32(eval_cores, 1, "threads evaluation may run on at once; each plays its share of the games with single-threaded blas");
+DEFINE_bool(pin_eval_threads, true, "keep evaluation threads off core 0 and the learner replicas' cores");
+DEFINE_string(eval_baselines, "random", "comma separated fixed opponents : random, or a model file as for --model");
+
+// measures the learner without pausing it. when an evaluation is due the learner's parameters are copied once into an
+// immutable snapshot shared by eval_cores worker threads; each loads it into its own inference network and plays greedy
+// (epsilon_test) games against every baseline on its own world. results reach the log and the eval_win_rate gauges
+// when the last worker is done. an evaluation still running when the next one is due makes that one skip.
+// workers stay out of training's way : blas runs single-threaded on them, they are pinned to the cores training leaves
+// free, and their ticks, decisions and timings are counted apart from training's.
+template <typename Network>
+class BackgroundEvaluation
+{
+public :
+	typedef boost::shared_ptr<Network> NetworkSp;
+	typedef std::shared_ptr<const std::vector<float>> Weights;
+
+	struct Baseline
+	{
+		std::string name;
+		std::unique_ptr<Metrics::Gauge> win_rate;
+	};
+
+	// wins, losses and draws of the evaluated network against one baseline
+	struct Score
+	{
+		int wins, losses, draws;
+	};
+
+	// everything a worker thread touches; built on the main thread, since caffe nets must not be constructed concurrently
+	struct Worker
+	{
+		Environment env;
+		GameState game_state;
+		NetworkSp player;
+		std::vector<NetworkSp> opponents; // per baseline, null plays random actions
+		EpisodeScheduler episodes;
+		std::vector<Score> scores;
+
+		Worker(const RandomStream& random, const Scenario& scenario)
+		: env(random.fork(RS_learners)), episodes(random,game_state,scenario)
+		{}
+	};
+
+	BackgroundEvaluation(const RandomStream& random, const Scenario& scenario)
+	: running(false), stopping(false)
+	{
+		CHECK_GT(FLAGS_eval_games,0);
+		CHECK_GT(FLAGS_eval_cores,0);
+		CHECK(Caffe::mode() == Caffe::CPU) << "background evaluation runs on cpu only";
+
+		std::istringstream list(FLAGS_eval_baselines);
+		for (std::string name; std::getline(list,name,',');)
+		{
+			if (name == "") continue;
+			baselines.push_back({name,std::unique_ptr<Metrics::Gauge>(new Metrics::Gauge("eval_win_rate","share of the last evaluation's games won against a baseline",str(format("baseline=\"%s\"")%name)))});
+		}
+		CHECK(!baselines.empty()) << "no evaluation baselines";
+
+		for (int i=0; i<FLAGS_eval_cores; ++i)
+		{
+			std::unique_ptr<Worker> w(new Worker(random.fork(i),scenario));
+			w->player = inference_network<Network>(w->env);
+			for (const auto& b : baselines)
+			{
+				w->opponents.push_back(b.name == "random" ? nullptr : inference_network<Network>(w->env,b.name));
+			}
+			workers.push_back(std::move(w));
+		}
+	}
+
+	~BackgroundEvaluation()
+	{
+		stopping = true;
+		if (runner.joinable()) runner.join();
+	}
+
+	// called by the main loop after each episode; never blocks on a running evaluation
+	void tick(int epoch, caffe::Net<float>& learner)
+	{
+		if (epoch == 0 || epoch % FLAGS_eval_interval != 0) return;
+
+		if (running)
+		{
+			LOG(WARNING) << "evaluation at episode " << epoch << " skipped, the previous one is still running";
+			return;
+		}
+		if (runner.joinable()) runner.join();
+
+		Weights weights(new std::vector<float>(freeze_params(learner)));
+		running = true;
+		runner = std::thread([this,weights,epoch]{ evaluate(weights,epoch); });
+	}
+
+private:
+	void evaluate(Weights weights, int epoch)
+	{
+		std::vector<std::thread> threads;
+		for (int i=0; i<workers.size(); ++i)
+		{
+			threads.push_back(std::thread([this,weights,i]{ play(*workers[i],*weights,i); }));
+		}
+		for (auto& t : threads)
+		{
+			t.join();
+		}
+
+		for (int b=0; b<baselines.size(); ++b)
+		{
+			Score total = {0,0,0};
+			for (const auto& w : workers)
+			{
+				total.wins += w->scores[b].wins;
+				total.losses += w->scores[b].losses;
+				total.draws += w->scores[b].draws;
+			}
+			const int games = total.wins + total.losses + total.draws;
+			if (games > 0)
+			{
+				baselines[b].win_rate->set(double(total.wins) / games);
+			}
+			LOG(INFO) << str(format("eval at episode %d vs %s : %d wins, %d losses, %d draws")%epoch%baselines[b].name%total.wins%total.losses%total.draws);
+		}
+		running = false;
+	}
+
+	// games i, i + eval_cores, ... of every baseline. game k always uses the same world stream and side,
+	// so successive evaluations face the same openings.
+	void play(Worker& w, const std::vector<float>& weights, int first)
+	{
+		Profiler::exclude_thread();
+		pin_to_spare_cores();
+		if (!set_thread_blas_threads(1))
+		{
+			LOG_FIRST_N(WARNING,1) << "evaluation threads share the learner's blas threads : the linked blas has no per-thread control";
+		}
+
+		thaw_params(weights,*w.player->net);
+		w.scores.assign(baselines.size(),Score{0,0,0});
+
+		for (int b=0; b<baselines.size(); ++b)
+		{
+			for (int game=first; game<FLAGS_eval_games && !stopping; game+=workers.size())
+			{
+				const int player_team = game % 2;
+				w.game_state.epoch = b * FLAGS_eval_games + game;
+				World& world = w.episodes.next([&](int team){ return team == player_team ? w.player : w.opponents[b]; });
+				world.evaluation = true;
+				while (!world.quit && !stopping)
+				{
+					world.tick();
+				}
+				if (!world.quit) break;
+
+				auto& score = w.scores[b];
+				if (world.final_winner == player_team) score.wins++;
+				else if (is_valid_team(world.final_winner)) score.losses++;
+				else score.draws++;
+			}
+		}
+	}
+
+	// every core from learner_replicas up : replica r is pinned to core r, and core 0 is left to the main thread
+	static void pin_to_spare_cores()
+	{
+		if (!FLAGS_pin_eval_threads) return;
+
+		cpu_set_t cpus;
+		CPU_ZERO(&cpus);
+		const int cores = std::max(1u,std::thread::hardware_concurrency());
+		for (int c=std::max(1,FLAGS_learner_replicas); c<cores; ++c)
+		{
+			CPU_SET(c,&cpus);
+		}
+		if (CPU_COUNT(&cpus) == 0)
+		{
+			LOG_FIRST_N(WARNING,1) << "no cores left for evaluation beside training's; evaluation threads are not pinned";
+			return;
+		}
+		if (pthread_setaffinity_np(pthread_self(),sizeof(cpus),&cpus) != 0)
+		{
+			LOG(WARNING) << "couldn't pin an evaluation thread";
+		}
+	}
+
+	std::vector<Baseline> baselines;
+	std::vector<std::unique_ptr<Worker>> workers;
+	std::thread runner;
+	std::atomic<bool> running, stopping;
+};
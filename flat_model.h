@@ -0,0 +1,215 @@
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <cstring>
+#include <set>
+
+// flat weight file : header, blob table, then 64-byte aligned float data.
+// loading maps the file and points the net's parameter blobs at it, no protobuf involved.
+struct FlatModelHeader
+{
+	enum { magic_value = 0x4c464e44, current_version = 1, alignment = 64 };
+
+	uint32_t magic;
+	uint32_t version;
+	int32_t temporal_window;
+	int32_t sight_diameter;
+	int32_t max_skills;
+	int32_t num_actions;
+	int32_t channels;
+	int32_t num_stats;
+	int32_t hidden_layer_size;
+	int32_t image_feature_size;
+	int32_t lowlevel_image_feature_size;
+	int32_t lowlevel_kernel_size;
+	int32_t kernel_size;
+	uint32_t num_blobs;
+	uint64_t file_size;
+
+	// batch size isn't recorded : weights carry over between geometries that differ only in it
+	template <typename G>
+	static FlatModelHeader of()
+	{
+		FlatModelHeader h;
+		std::memset(&h,0,sizeof(h));
+		h.magic = magic_value;
+		h.version = current_version;
+		h.temporal_window = G::temporal_window;
+		h.sight_diameter = G::sight_diameter;
+		h.max_skills = ::max_skills;
+		h.num_actions = ::num_actions;
+		h.channels = ::channels;
+		h.num_stats = ::num_stats;
+		h.hidden_layer_size = HiddenLayerSize;
+		h.image_feature_size = ImageFeatureSize;
+		h.lowlevel_image_feature_size = LowLevelImageFeatureSize;
+		h.lowlevel_kernel_size = LowLevelKernelSize;
+		h.kernel_size = KernelSize;
+		return h;
+	}
+
+	bool has_same_geometry(const FlatModelHeader& o) const
+	{
+		// everything between version and num_blobs
+		return std::memcmp(&temporal_window,&o.temporal_window,(const char*)&num_blobs - (const char*)&temporal_window) == 0;
+	}
+};
+
+struct FlatBlobHeader
+{
+	char layer[48];
+	int32_t index;
+	int32_t num, channels, height, width;
+	uint64_t offset;
+};
+
+class FlatModel
+{
+public :
+	typedef caffe::Net<float> NetType;
+
+	static bool is_flat(const std::string& file)
+	{
+		uint32_t magic = 0;
+		std::ifstream in(file, std::ios::binary);
+		in.read(reinterpret_cast<char*>(&magic),sizeof(magic));
+		return in && magic == FlatModelHeader::magic_value;
+	}
+
+	static uint64_t align(uint64_t offset)
+	{
+		return (offset + FlatModelHeader::alignment - 1) / FlatModelHeader::alignment * FlatModelHeader::alignment;
+	}
+
+	static void write(const std::string& file, NetType& net, FlatModelHeader header)
+	{
+		std::vector<FlatBlobHeader> table;
+		std::vector<const caffe::Blob<float>*> blobs;
+
+		const auto& layers = net.layers();
+		const auto& names = net.layer_names();
+		for (int l=0; l<layers.size(); ++l)
+		{
+			const auto& layer_blobs = layers[l]->blobs();
+			for (int i=0; i<layer_blobs.size(); ++i)
+			{
+				const auto& blob = *layer_blobs[i];
+				FlatBlobHeader b;
+				std::memset(&b,0,sizeof(b));
+				CHECK(names[l].size() < sizeof(b.layer)) << "layer name too long for flat model: " << names[l];
+				std::strncpy(b.layer,names[l].c_str(),sizeof(b.layer)-1);
+				b.index = i;
+				b.num = blob.num();
+				b.channels = blob.channels();
+				b.height = blob.height();
+				b.width = blob.width();
+				table.push_back(b);
+				blobs.push_back(&blob);
+			}
+		}
+
+		header.num_blobs = table.size();
+
+		uint64_t offset = align(sizeof(FlatModelHeader) + table.size() * sizeof(FlatBlobHeader));
+		for (int i=0; i<table.size(); ++i)
+		{
+			table[i].offset = offset;
+			offset = align(offset + blobs[i]->count() * sizeof(float));
+		}
+		header.file_size = offset;
+
+		std::ofstream out(file, std::ios::binary | std::ios::trunc);
+		CHECK(out) << "couldn't open " << file;
+
+		auto pad_to = [&](uint64_t pos){
+			static const char zeros[FlatModelHeader::alignment] = {};
+			out.write(zeros,pos - out.tellp());
+		};
+
+		out.write(reinterpret_cast<const char*>(&header),sizeof(header));
+		out.write(reinterpret_cast<const char*>(table.data()),table.size() * sizeof(FlatBlobHeader));
+		for (int i=0; i<table.size(); ++i)
+		{
+			pad_to(table[i].offset);
+			out.write(reinterpret_cast<const char*>(blobs[i]->cpu_data()),blobs[i]->count() * sizeof(float));
+		}
+		pad_to(header.file_size);
+
+		CHECK(out) << "failed writing " << file;
+		LOG(INFO) << "exported " << table.size() << " blobs (" << header.file_size << " bytes) to " << file;
+	}
+
+	// private copy-on-write mapping; must outlive every net bound to it.
+	class Mapping
+	{
+	public :
+		Mapping(const std::string& file, const FlatModelHeader& expected)
+		: data(nullptr), size(0)
+		{
+			int fd = open(file.c_str(), O_RDONLY);
+			CHECK(fd >= 0) << "couldn't open " << file;
+
+			struct stat st;
+			CHECK(fstat(fd,&st) == 0);
+			size = st.st_size;
+			CHECK(size >= sizeof(FlatModelHeader)) << file << " is too small to be a flat model";
+
+			data = static_cast<char*>(mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0));
+			close(fd);
+			CHECK(data != MAP_FAILED) << "couldn't map " << file;
+
+			const auto& h = header();
+			CHECK(h.magic == FlatModelHeader::magic_value) << file << " is not a flat model";
+			CHECK(h.version == FlatModelHeader::current_version) << file << " has version " << h.version;
+			CHECK(h.file_size == size) << file << " is truncated";
+			CHECK(h.has_same_geometry(expected)) << file << " was exported with a different geometry";
+		}
+
+		~Mapping()
+		{
+			munmap(data,size);
+		}
+
+		const FlatModelHeader& header() const { return *reinterpret_cast<const FlatModelHeader*>(data); }
+		const FlatBlobHeader* table() const { return reinterpret_cast<const FlatBlobHeader*>(data + sizeof(FlatModelHeader)); }
+
+		void bind(NetType& net)
+		{
+			const auto& h = header();
+			CHECK(sizeof(FlatModelHeader) + h.num_blobs * sizeof(FlatBlobHeader) <= size);
+
+			std::set<const caffe::Blob<float>*> bound;
+			for (int i=0; i<h.num_blobs; ++i)
+			{
+				const auto& b = table()[i];
+				auto layer = net.layer_by_name(b.layer);
+				CHECK(layer) << "unknown layer in flat model: " << b.layer;
+				CHECK(b.index < layer->blobs().size());
+
+				auto& blob = *layer->blobs()[b.index];
+				CHECK(blob.num() == b.num && blob.channels() == b.channels && blob.height() == b.height && blob.width() == b.width)
+					<< "shape mismatch for " << b.layer << "[" << b.index << "]";
+				CHECK(b.offset % FlatModelHeader::alignment == 0 && b.offset + blob.count() * sizeof(float) <= size);
+
+				blob.data()->set_cpu_data(data + b.offset);
+				bound.insert(&blob);
+			}
+
+			// a parameter the file doesn't cover would silently keep its filler init
+			for (int l=0; l<net.layers().size(); ++l)
+			{
+				const auto& blobs = net.layers()[l]->blobs();
+				for (int j=0; j<blobs.size(); ++j)
+				{
+					CHECK(bound.count(blobs[j].get())) << "flat model has no data for " << net.layer_names()[l] << "[" << j << "]";
+				}
+			}
+			LOG(INFO) << "mapped " << bound.size() << " blobs";
+		}
+
+	private:
+		char* data;
+		size_t size;
+	};
+};
@@ -0,0 +1,136 @@
+// convolution, bias and leaky relu in one pass over the output. at the sizes config.h produces (8x8 input, kernel 4, stride 2)
+// im2col + gemm is all copying and call overhead, so this loops directly and never materializes the column buffer.
+// it takes over a CONVOLUTION layer's parameter blobs, and its output holds post-activation values, from which backward
+// recovers the relu's slope just as an in-place RELU does.
+// this caffe builds layers through a fixed type switch, so a net can't name it : the nets keep caffe's conv + RELU pairs, and
+// only bench_dqn includes this, to check it against them numerically and time both, until a layer factory can register it.
+class ConvLeakyReLULayer : public caffe::Layer<float>
+{
+public :
+	ConvLeakyReLULayer(const caffe::LayerParameter& param, float negative_slope, const vector<shared_ptr<Blob<float>>>& params)
+	: Layer<float>(param), negative_slope(negative_slope)
+	{
+		this->blobs_ = params;
+	}
+
+	virtual inline caffe::LayerParameter_LayerType type() const { return caffe::LayerParameter_LayerType_CONVOLUTION; }
+	virtual inline int ExactNumBottomBlobs() const { return 1; }
+	virtual inline int ExactNumTopBlobs() const { return 1; }
+
+	virtual void LayerSetUp(const vector<Blob<float>*>& bottom, vector<Blob<float>*>* top)
+	{
+		const auto& conv = this->layer_param_.convolution_param();
+		stride = conv.stride();
+		pad = conv.pad();
+
+		const auto& weights = *this->blobs_[0];
+		num_output = weights.num();
+		kernel = weights.height();
+		CHECK_EQ(weights.height(),weights.width()) << "square kernels only";
+		CHECK_EQ(weights.channels(),bottom[0]->channels()) << "grouped convolution is not supported";
+	}
+
+	virtual void Reshape(const vector<Blob<float>*>& bottom, vector<Blob<float>*>* top)
+	{
+		channels = bottom[0]->channels();
+		height = bottom[0]->height();
+		width = bottom[0]->width();
+		height_out = (height + 2 * pad - kernel) / stride + 1;
+		width_out = (width + 2 * pad - kernel) / stride + 1;
+		(*top)[0]->Reshape(bottom[0]->num(),num_output,height_out,width_out);
+	}
+
+protected:
+	virtual void Forward_cpu(const vector<Blob<float>*>& bottom, vector<Blob<float>*>* top)
+	{
+		const float* in = bottom[0]->cpu_data();
+		const float* w = this->blobs_[0]->cpu_data();
+		const float* b = this->blobs_.size() > 1 ? this->blobs_[1]->cpu_data() : nullptr;
+		float* out = (*top)[0]->mutable_cpu_data();
+
+		for (int n=0; n<bottom[0]->num(); ++n)
+		{
+			const float* image = in + bottom[0]->offset(n);
+			for (int o=0; o<num_output; ++o)
+			{
+				const float* filter = w + o * channels * kernel * kernel;
+				for (int oy=0; oy<height_out; ++oy)
+				{
+					for (int ox=0; ox<width_out; ++ox)
+					{
+						float sum = b ? b[o] : 0;
+						each_tap(oy,ox,[&](int tap, int pixel){
+							sum += filter[tap] * image[pixel];
+						});
+						*out++ = sum > 0 ? sum : sum * negative_slope;
+					}
+				}
+			}
+		}
+	}
+
+	virtual void Backward_cpu(const vector<Blob<float>*>& top, const vector<bool>& propagate_down, vector<Blob<float>*>* bottom)
+	{
+		const float* top_data = top[0]->cpu_data();
+		const float* top_diff = top[0]->cpu_diff();
+		const float* in = (*bottom)[0]->cpu_data();
+		const float* w = this->blobs_[0]->cpu_data();
+		float* w_diff = this->blobs_[0]->mutable_cpu_diff();
+		float* b_diff = this->blobs_.size() > 1 ? this->blobs_[1]->mutable_cpu_diff() : nullptr;
+		float* in_diff = propagate_down[0] ? (*bottom)[0]->mutable_cpu_diff() : nullptr;
+
+		std::fill(w_diff, w_diff + this->blobs_[0]->count(), 0);
+		if (b_diff) std::fill(b_diff, b_diff + this->blobs_[1]->count(), 0);
+		if (in_diff) std::fill(in_diff, in_diff + (*bottom)[0]->count(), 0);
+
+		for (int n=0; n<(*bottom)[0]->num(); ++n)
+		{
+			const int image = (*bottom)[0]->offset(n);
+			for (int o=0; o<num_output; ++o)
+			{
+				const int filter = o * channels * kernel * kernel;
+				for (int oy=0; oy<height_out; ++oy)
+				{
+					for (int ox=0; ox<width_out; ++ox, ++top_data, ++top_diff)
+					{
+						const float g = *top_diff * (*top_data > 0 ? 1 : negative_slope);
+						if (g == 0) continue;
+
+						if (b_diff) b_diff[o] += g;
+						each_tap(oy,ox,[&](int tap, int pixel){
+							w_diff[filter + tap] += g * in[image + pixel];
+							if (in_diff) in_diff[image + pixel] += g * w[filter + tap];
+						});
+					}
+				}
+			}
+		}
+	}
+
+private:
+	// fn(index into one filter, index into one image) for every kernel tap of output (oy,ox) that lands inside the image
+	template <typename Fn>
+	void each_tap(int oy, int ox, Fn fn) const
+	{
+		for (int c=0; c<channels; ++c)
+		{
+			for (int ky=0; ky<kernel; ++ky)
+			{
+				const int iy = oy * stride - pad + ky;
+				if (iy < 0 || iy >= height) continue;
+
+				for (int kx=0; kx<kernel; ++kx)
+				{
+					const int ix = ox * stride - pad + kx;
+					if (ix < 0 || ix >= width) continue;
+
+					fn((c * kernel + ky) * kernel + kx,(c * height + iy) * width + ix);
+				}
+			}
+		}
+	}
+
+	float negative_slope;
+	int num_output, kernel, stride, pad;
+	int channels, height, width, height_out, width_out;
+};
@@ -2,6 +2,9 @@ auto ANSI = "\033[";
 
 const float radius = 0.0125;
 
+DEFINE_int32(world_size, 8, "width and height of the map, independent of the agents' sight");
+DEFINE_double(influence_cutoff, 4, "observations leave out agents whose influence on every cell in sight is below level * exp(-cutoff^2); 0 keeps every agent on the map");
+
 struct GameState
 {
 	std::array<int,2> scores;
@@ -41,11 +44,6 @@ struct Vector
 
 	Vector() {}
 	Vector(float x, float y) : x(x), y(y) {}
-
-	bool is_invalid() const
-	{
-		return (x < 0 || y < 0 || x >= world_size || y >= world_size);
-	}
 };
 
 Vector operator * (const Vector& a, float k)
@@ -93,9 +91,11 @@ public:
 	World* world;
 	Vector pos;
 	bool pending_kill;
+	RandomStream random; // forked from the world's stream by spawn order
+	int order; // spawn index within the episode, which is also its place in world.agents
 
 	Agent()
-	: world(world), pos(0,0), pending_kill(false)
+	: world(world), pos(0,0), pending_kill(false), order(0)
 	{}
 
 	virtual bool is_friendly(int team) const { return false; }
@@ -109,6 +109,13 @@ public:
 	virtual void take_event(const Event& e) {}
 	virtual void game_over(int winner) {}
 
+	// per-episode state back to as-constructed, for agents reused from a world's pool
+	virtual void respawn()
+	{
+		pos = Vector(0,0);
+		pending_kill = false;
+	}
+
 	virtual void forward() {}
 	virtual void tick() 
 	{
@@ -138,6 +145,7 @@ struct Event
 	int lifespan;	
 	float radius;
 	Agent* instigator;
+	uint64_t serial; // creation order within its world, set when the world stores it
 
 	Event() {}
 	Event(EventType type, const Vector& location, int lifespan = 1, float radius = ::radius) : type(type), location(location), lifespan(lifespan), radius(radius)
@@ -161,12 +169,288 @@ struct Event
 	}
 };
 
+// long-lived zones (hellpot, honeypot) are kept in a short list of their own; transient events
+// live in a pool, expire through a timing wheel slot keyed by their expiry tick and are found through a coarse grid.
+// an event with lifespan L added before the n-th expire() is gone from it on, as when lifespans were counted down.
+// events added while dispatching are staged until end_dispatch(), so a dispatch only sees what existed when it began.
+// every stored event gets the next serial, so callers can put what a query finds back in creation order.
+class EventSystem
+{
+public :
+	enum { wheel_size = 64 };	// events living this long or longer are zones
+	enum { cell_size = 2 };
+
+	EventSystem(const Vector& size)
+	: clock(0), next_serial(0), dispatching(false), max_radius(0),
+	  columns(std::max(1,int(std::ceil(size.x / cell_size)))), rows(std::max(1,int(std::ceil(size.y / cell_size)))),
+	  grid(columns * rows)
+	{}
+
+	void add(const Event& event)
+	{
+		if (dispatching)
+		{
+			staged.push_back(event);
+			return;
+		}
+
+		const int expire_at = clock + std::max(1,event.lifespan);
+		if (event.lifespan >= wheel_size)
+		{
+			zones.push_back({event,expire_at});
+			zones.back().event.serial = next_serial++;
+			return;
+		}
+
+		int index;
+		if (free_slots.empty())
+		{
+			index = pool.size();
+			pool.push_back(event);
+		}
+		else
+		{
+			index = free_slots.back();
+			free_slots.pop_back();
+			pool[index] = event;
+		}
+		pool[index].serial = next_serial++;
+		wheel[expire_at % wheel_size].push_back(index);
+		grid[cell_of(event.location)].push_back(index);
+		max_radius = std::max(max_radius,event.radius);
+	}
+
+	// once at the start of every tick
+	void expire()
+	{
+		clock++;
+
+		auto& due = wheel[clock % wheel_size];
+		for (auto index : due)
+		{
+			auto& cell = grid[cell_of(pool[index].location)];
+			cell.erase(std::find(cell.begin(),cell.end(),index));
+			free_slots.push_back(index);
+		}
+		due.clear();
+
+		zones.erase(
+			std::remove_if(zones.begin(),zones.end(),[=](const Zone& z){return z.expire_at <= clock;}),
+			zones.end());
+	}
+
+	void begin_dispatch()
+	{
+		dispatching = true;
+	}
+
+	void end_dispatch()
+	{
+		dispatching = false;
+		for (const auto& e : staged)
+		{
+			add(e);
+		}
+		staged.clear();
+	}
+
+	// every event whose disc reaches within r of p
+	template <typename Fn>
+	void query(const Vector& p, float r, Fn fn) const
+	{
+		for (const auto& z : zones)
+		{
+			if (distance_squared(p,z.event.location) <= square(r + z.event.radius)) fn(z.event);
+		}
+
+		const float reach = r + max_radius;
+		const int x0 = clamp_column(int(std::floor((p.x - reach) / cell_size))), x1 = clamp_column(int(std::floor((p.x + reach) / cell_size)));
+		const int y0 = clamp_row(int(std::floor((p.y - reach) / cell_size))), y1 = clamp_row(int(std::floor((p.y + reach) / cell_size)));
+		for (int y=y0; y<=y1; ++y)
+		{
+			for (int x=x0; x<=x1; ++x)
+			{
+				for (auto index : grid[x + y * columns])
+				{
+					const auto& e = pool[index];
+					if (distance_squared(p,e.location) <= square(r + e.radius)) fn(e);
+				}
+			}
+		}
+	}
+
+	template <typename Fn>
+	void for_each(Fn fn) const
+	{
+		for (const auto& z : zones)
+		{
+			fn(z.event);
+		}
+		for (const auto& cell : grid)
+		{
+			for (auto index : cell)
+			{
+				fn(pool[index]);
+			}
+		}
+	}
+
+	size_t size() const
+	{
+		return zones.size() + pool.size() - free_slots.size();
+	}
+
+	// drops every event but keeps all storage
+	void clear()
+	{
+		clock = 0;
+		next_serial = 0;
+		dispatching = false;
+		max_radius = 0;
+		zones.clear();
+		pool.clear();
+		free_slots.clear();
+		for (auto& slot : wheel) slot.clear();
+		for (auto& cell : grid) cell.clear();
+		staged.clear();
+	}
+
+private:
+	struct Zone
+	{
+		Event event;
+		int expire_at;
+	};
+
+	int clamp_column(int x) const { return std::min(columns-1,std::max(0,x)); }
+	int clamp_row(int y) const { return std::min(rows-1,std::max(0,y)); }
+
+	int cell_of(const Vector& p) const
+	{
+		return clamp_column(int(std::floor(p.x / cell_size))) + clamp_row(int(std::floor(p.y / cell_size))) * columns;
+	}
+
+	int clock;
+	uint64_t next_serial;
+	bool dispatching;
+	float max_radius;
+	int columns, rows;
+
+	std::vector<Zone> zones;
+	std::vector<Event> pool;
+	std::vector<int> free_slots;
+	std::array<std::vector<int>,wheel_size> wheel;
+	std::vector<std::vector<int>> grid;
+	std::vector<Event> staged;
+};
+
+// agents by the unit cell their position falls in, so neighbourhood queries on a crowded map visit only nearby cells.
+// positions change only through World::place, which keeps the grid in step.
+class AgentGrid
+{
+public :
+	enum { cell_size = 1 };
+
+	AgentGrid(const Vector& size)
+	: columns(std::max(1,int(std::ceil(size.x / cell_size)))), rows(std::max(1,int(std::ceil(size.y / cell_size)))),
+	  grid(columns * rows)
+	{}
+
+	void add(Agent* a)
+	{
+		grid[cell_of(a->pos)].push_back(a);
+	}
+
+	void remove(Agent* a)
+	{
+		auto& cell = grid[cell_of(a->pos)];
+		cell.erase(std::find(cell.begin(),cell.end(),a));
+	}
+
+	// before a's position changes to p
+	void move(Agent* a, const Vector& p)
+	{
+		const int from = cell_of(a->pos), to = cell_of(p);
+		if (from == to) return;
+
+		auto& cell = grid[from];
+		cell.erase(std::find(cell.begin(),cell.end(),a));
+		grid[to].push_back(a);
+	}
+
+	// every agent in a cell reaching within r of p, in no particular order; fn tests distances itself
+	template <typename Fn>
+	void query(const Vector& p, float r, Fn fn) const
+	{
+		const int x0 = clamp_column(int(std::floor((p.x - r) / cell_size))), x1 = clamp_column(int(std::floor((p.x + r) / cell_size)));
+		const int y0 = clamp_row(int(std::floor((p.y - r) / cell_size))), y1 = clamp_row(int(std::floor((p.y + r) / cell_size)));
+		for (int y=y0; y<=y1; ++y)
+		{
+			for (int x=x0; x<=x1; ++x)
+			{
+				for (auto a : grid[x + y * columns])
+				{
+					fn(a);
+				}
+			}
+		}
+	}
+
+	// keeps all storage
+	void clear()
+	{
+		for (auto& cell : grid) cell.clear();
+	}
+
+private:
+	int clamp_column(int x) const { return std::min(columns-1,std::max(0,x)); }
+	int clamp_row(int y) const { return std::min(rows-1,std::max(0,y)); }
+
+	int cell_of(const Vector& p) const
+	{
+		return clamp_column(int(std::floor(p.x / cell_size))) + clamp_row(int(std::floor(p.y / cell_size))) * columns;
+	}
+
+	int columns, rows;
+	std::vector<std::vector<Agent*>> grid;
+};
+
+// every decision of an episode in the order agents take them. a recording world appends to it,
+// a replaying world takes its decisions from it instead of from brains.
+struct ActionTape
+{
+	std::vector<uint8_t> actions;
+	size_t cursor;
+	bool replaying;
+
+	ActionTape() : cursor(0), replaying(false) {}
+
+	void record(int action)
+	{
+		actions.push_back(action);
+	}
+
+	bool at_end() const
+	{
+		return cursor >= actions.size();
+	}
+
+	int next()
+	{
+		assert(!at_end());
+		return actions[cursor++];
+	}
+};
+
 class World {
 public:
-	std::mt19937& random_engine;
+	mutable RandomStream random;
+	RandomStream episode_random; // as the episode began, before any draw
+	ActionTape* tape; // not owned; null when neither recording nor replaying
+	bool evaluation; // played by background evaluation; its ticks and decisions count apart from training's
 	int randint(int N) const
 	{
-		return std::uniform_int_distribution<>(0,N-1)(random_engine);
+		return random.randint(N);
 	}
 	bool should_display() const
 	{
@@ -176,25 +460,53 @@ public:
 	Vector size;
 	std::list< shared_ptr<Agent> > agents;	
 	std::list< shared_ptr<Agent> > killed_agents;
+	std::list< shared_ptr<Agent> > pool; // agents of earlier episodes, reused by spawn_pooled
 	GameState& game_state;	
 	bool quit;	
 	int final_winner;
 	int world_clock;
-	std::vector<Event> events;
+	EventSystem events;
+	AgentGrid grid; // every agent of agents
 	int geom;
+	int num_spawned;
 	
-	World(std::mt19937& random_engine, GameState& game_state) 
-	: random_engine(random_engine), size(world_size,world_size), game_state(game_state), quit(false), final_winner(-1), world_clock(0)
+	World(const RandomStream& random, GameState& game_state, int world_size = FLAGS_world_size) 
+	: random(random), episode_random(random), tape(nullptr), evaluation(false), size(world_size,world_size), game_state(game_state), quit(false), final_winner(-1), world_clock(0), events(size), grid(size), num_spawned(0),
+	  dominant_team_stale(true)
 	{		
-		geom = std::uniform_int_distribution<>(0,1)(random_engine);		
+		begin_episode();
+	}
 
-		add_event({Event::event_hellpot,random_location(),100000,world_size / 8});		
-		add_event({Event::event_honeypot,random_location(),100000,world_size / 8});		
+	// starts a new episode in place : agents move to the pool, events and lists keep their storage
+	void reset(const RandomStream& random)
+	{
+		pool.splice(pool.end(),agents);
+		pool.splice(pool.end(),killed_agents);
+		events.clear();
+		grid.clear();
+		dominant_team_stale = true;
+
+		this->random = random;
+		episode_random = random;
+		quit = false;
+		final_winner = -1;
+		world_clock = 0;
+		num_spawned = 0;
+
+		begin_episode();
+	}
+
+	void begin_episode()
+	{
+		geom = randint(2);		
+
+		add_event({Event::event_hellpot,random_location(),100000,float(int(size.x) / 8)});		
+		add_event({Event::event_honeypot,random_location(),100000,float(int(size.x) / 8)});		
 	}
 
 	void add_event(const Event& event)
 	{
-		events.push_back(event);
+		events.add(event);
 	}	
 
 	void game_over(int winner)
@@ -233,12 +545,48 @@ public:
 	{
 		auto agent = l();
 		agent->world = this;		
+		agent->order = num_spawned;
+		agent->random = random.fork(num_spawned++);
 		agents.push_back( shared_ptr<Agent>(agent) );
+		grid.add(agent);
+		dominant_team_stale = true;
 
 		return agent;
 	}
 
+	// respawns the first pooled agent match accepts, or spawns a new one from l
+	template <typename Match>
+	Agent* spawn_pooled(Match match, std::function<Agent*(void)> l)
+	{
+		for (auto it = pool.begin(); it != pool.end(); ++it)
+		{
+			if (match(it->get()))
+			{
+				auto agent = it->get();
+				agents.splice(agents.end(),pool,it);
+				agent->respawn();
+				agent->order = num_spawned;
+				agent->random = random.fork(num_spawned++);
+				grid.add(agent);
+				dominant_team_stale = true;
+				return agent;
+			}
+		}
+		return spawn(l);
+	}
+
+	// the team with more agents alive; counted again only after a spawn or a death
 	int get_dominant_team() const
+	{
+		if (dominant_team_stale)
+		{
+			dominant_team = count_dominant_team();
+			dominant_team_stale = false;
+		}
+		return dominant_team;
+	}
+
+	int count_dominant_team() const
 	{
 		int powers[2] = {0,0};
 		for (auto a : agents)
@@ -268,8 +616,8 @@ public:
 
 	Vector random_location() const
 	{
-		std::uniform_real_distribution<> dist(0,world_size);		
-		return Vector(dist(random_engine),dist(random_engine));
+		const float x = random.uniform() * size.x;
+		return Vector(x,random.uniform() * size.y);
 	}
 
 	template <typename T>
@@ -289,64 +637,89 @@ public:
 
 	void tick() 
 	{
-		events.erase(
-			std::remove_if(events.begin(),events.end(),[=](Event& e){return --e.lifespan <= 0;}),
-			events.end());
+		PROFILE_SCOPE(tick);
+
+		{
+			PROFILE_SCOPE(tick_expire_events);
+			events.expire();
+		}
 
 		game_state.clock++;
+		Metrics::count(evaluation ? MC_eval_env_steps : MC_env_steps);
 		if (world_clock++ > 1000)
 		{		
 			game_over(get_dominant_team());
 		}
 		
-		for (auto a : agents)
 		{
-			a->forward();
+			PROFILE_SCOPE(tick_forward);
+			for (auto a : agents)
+			{
+				a->forward();
+			}
 		}
 
-		for (const auto& e : events)
 		{
+			PROFILE_SCOPE(tick_events);
+			// every event in creation order, and for each the agents it reaches in spawn order, as when all events
+			// were tested against all agents : which damage and heal land first decides deaths and kill credit
+			events.begin_dispatch();
+			hits.clear();
 			for (auto a : agents)
 			{
-				if (distance_squared(a->pos, e.location) <= square(radius+e.radius))
-				{
-					a->take_event(e);
-				}
+				events.query(a->pos,radius,[&](const Event& e){ hits.push_back({&e,a.get()}); });
+			}		
+			std::sort(hits.begin(),hits.end(),[](const Hit& x, const Hit& y)
+			{
+				return x.event->serial != y.event->serial ? x.event->serial < y.event->serial : x.agent->order < y.agent->order;
+			});
+			for (const auto& hit : hits)
+			{
+				hit.agent->take_event(*hit.event);
 			}
-		}		
+			events.end_dispatch();
+		}
 
-		for (auto a : agents)
 		{
-			a->tick();
-			assert(!a->pos.is_invalid());
+			PROFILE_SCOPE(tick_agents);
+			for (auto a : agents)
+			{
+				a->tick();
+				assert(contains(a->pos));
+			}
 		}
 
-		for (auto a : agents)
 		{
-			a->backward();
-		}				
+			PROFILE_SCOPE(tick_backward);
+			for (auto a : agents)
+			{
+				a->backward();
+			}				
+		}
 
+		PROFILE_SCOPE(tick_gc);
 		collect_garbage();		
 	}
 
 	void collect_garbage()
 	{
 		bool killed_any_body = false;
-		agents.remove_if([&](shared_ptr<Agent> a){
-			if (a->pending_kill)
+		for (auto it = agents.begin(); it != agents.end();)
+		{
+			auto next = std::next(it);
+			if ((*it)->pending_kill)
 			{
 				killed_any_body = true;
-				killed_agents.push_back(a);
-				return true;
+				grid.remove(it->get());
+				killed_agents.splice(killed_agents.end(),agents,it);
 			}
-			else
-			{
-				return false;
-			}
-		});		
+			it = next;
+		}
 
 		if (killed_any_body)
 		{
+			dominant_team_stale = true;
+
 			bool team0 = is_team_alive(0);
 			bool team1 = is_team_alive(1);
 			if (!team0 && team1)
@@ -368,14 +741,27 @@ public:
 	{
 		if (is_solid(x)) return false;
 	
-		for (auto a : agents)
+		bool vacant = true;
+		grid.query(x,radius*2,[&](const Agent* a)
 		{
-			if (a.get() != self && distance_squared(a->pos,x) <= square(radius*2))
+			if (a != self && distance_squared(a->pos,x) <= square(radius*2))
 			{
-				return false;
+				vacant = false;
 			}
-		}
-		return true;
+		});
+		return vacant;
+	}
+
+	// moves a, which is in agents, to p
+	void place(Agent* a, const Vector& p)
+	{
+		grid.move(a,p);
+		a->pos = p;
+	}
+
+	bool contains(const Vector& v) const
+	{
+		return v.x >= 0 && v.y >= 0 && v.x < size.x && v.y < size.y;
 	}
 
 	bool can_move_to(const Agent* a,const Vector& start, const Vector& end) const
@@ -385,7 +771,12 @@ public:
 
 	bool is_solid(const Vector& v) const
 	{	
-		if (v.is_invalid()) return true;
+		return is_solid(geom,size,v);
+	}
+
+	static bool is_solid(int geom, const Vector& size, const Vector& v)
+	{	
+		if (v.x < 0 || v.y < 0 || v.x >= size.x || v.y >= size.y) return true;
 
 		switch (geom)
 		{
@@ -394,14 +785,17 @@ public:
 		default : return false;
 		}			
 	}
-};
 
-class AgentBrain : public Brain
-{
-public:	
-	AgentBrain(NetworkSp network,World* world) : Brain(network), world(world) {}
-	World* world;
-	virtual int forward(Actable* agent ) = 0;	
+private:
+	struct Hit
+	{
+		const Event* event;
+		Agent* agent;
+	};
+
+	std::vector<Hit> hits; // scratch for dispatching events, keeps its capacity between ticks
+	mutable int dominant_team;
+	mutable bool dominant_team_stale;
 };
 
 class Actable : public Agent
@@ -419,16 +813,36 @@ public:
 	int num_actions;
 	int action;	
 
+	// valid actions for this tick, computed once before the brain is consulted
+	ActionMask action_mask;
+
+	virtual void update_action_mask()
+	{
+		action_mask.reset();
+		for (int action=0; action<num_actions; ++action)
+		{
+			action_mask[action] = is_valid_action(action);
+		}
+	}
+
 	virtual void forward()
 	{
+		PROFILE_SCOPE(decision);
+
 		Base::forward();
 
-		if (brain)
+		update_action_mask();
+
+		if (world->tape && world->tape->replaying)
+		{
+			action = world->tape->next();
+		}
+		else if (brain)
 		{
 			for (;;)
 			{
 				action = brain->forward(this);
-				if (is_valid_action(action)) break;
+				if (::is_valid_action(action) && action_mask[action]) break;
 				
 				action = 0;
 				break;
@@ -439,6 +853,11 @@ public:
 			action = random_action();
 			assert(is_valid_action(action));
 		}
+
+		if (world->tape && !world->tape->replaying)
+		{
+			world->tape->record(action);
+		}
 	}
 
 	virtual void check_sanity() const
@@ -448,6 +867,20 @@ public:
 		assert(!std::isnan(reward));
 	}
 
+	virtual void respawn()
+	{
+		Base::respawn();
+
+		reward = 0;
+		acc_reward = 0;
+		action = 0;
+		action_mask.reset();
+		if (brain)
+		{
+			brain->reset();
+		}
+	}
+
 	virtual void tick()
 	{
 		Base::tick();
@@ -468,17 +901,17 @@ public:
 
 			brain->backward(std::min(1.0f,std::max(-1.0f,reward)));
 
-			acc_reward = acc_reward * brain->network->trainer.gamma + reward;
+			acc_reward = acc_reward * brain->gamma() + reward;
 			reward = 0;
 		}
 	}
 
 	virtual int random_action() 
 	{
-		for (;;)
+		int nth = random.randint(action_mask.count());
+		for (action=0;; ++action)
 		{
-			action = world->randint(num_actions);
-			if (is_valid_action(action))
+			if (action_mask[action] && nth-- == 0)
 			{
 				return action;
 			}
@@ -545,7 +978,7 @@ public:
 
 		if (world->can_move_to(this,pos,new_pos))
 		{			
-			pos = new_pos;
+			world->place(this,new_pos);
 		}
 	}
 };
@@ -581,6 +1014,8 @@ public:
 
 	void dump()
 	{
+		PROFILE_SCOPE(display_dump);
+
 		if (needs_clear)
 		{
 			needs_clear = false;
@@ -626,16 +1061,14 @@ public:
 
 					if (found) break;
 					
-					for (const auto& a : world.events)
+					world.events.query(p,1.0f/zoom,[&](const Event& a)
 					{
-						float r2 = 1.0f/zoom + a.radius;
-						if (distance_squared(p, a.location) < r2*r2)
+						if (!found)
 						{			
 							found = true;			
 							line += a.one_letter();
-							break;
 						}								
-					}
+					});
 
 					if (found) break;
 
@@ -709,6 +1142,7 @@ public :
 	
 	std::array<SkillParams,max_skills> skill_params;
 	std::array<int,max_skills> cooldown;
+	std::array<Pawn*,max_skills> targets; // refreshed by update_action_mask
 
 	float attack_reward, kill_reward;
 
@@ -743,7 +1177,22 @@ public :
 	: Base(speed), type(type), max_health(in_max_health), skill_params(skill_params), team(team), health(in_max_health), code(code), death_timer(0), attack_reward(attack_reward), kill_reward(kill_reward)
 	{
 		std::fill(cooldown.begin(),cooldown.end(),0);
+		std::fill(targets.begin(),targets.end(),nullptr);
 		num_actions += max_skills;
+		assert(skill_params[0].range <= max_influence_range);
+	}
+
+	// the widest influence (skill_params[0].range) of any pawn type, which bounds how far observations look
+	static constexpr float max_influence_range = 1.0f;
+
+	virtual void respawn()
+	{
+		Base::respawn();
+
+		health = max_health;
+		death_timer = 0;
+		std::fill(cooldown.begin(),cooldown.end(),0);
+		std::fill(targets.begin(),targets.end(),nullptr);
 	}
 
 	virtual void game_over(int winner)
@@ -757,7 +1206,10 @@ public :
 			reward = -100.0f;
 		}
 
-		brain->flush(SingleFrameSp());
+		if (brain)
+		{
+			brain->end_episode();
+		}
 	}
 
 	virtual void check_sanity() const
@@ -813,23 +1265,79 @@ public :
 		const auto& param = skill_params[slot];
 		float best_dist = square(param.range+1);
 		Pawn* best = nullptr;
-		for (auto a:world->agents)
+		world->grid.query(pos,param.range+1,[&](Agent* a)
 		{
-			auto b = dynamic_cast<Pawn*>(a.get());
+			auto b = dynamic_cast<Pawn*>(a);
 			if (can_affect(param.type,b))
 			{
 				auto dist = distance_squared(pos,b->pos);
-				if (dist < best_dist)
+				if (is_nearer(dist,b,best_dist,best))
 				{
 					// std::cout << "found_target" << dist << pos.x << "," << pos.y << ":" << b->pos.x << b->pos.y;
 					best_dist = dist;
 					best = b;
 				}
 			}
-		}			
+		});
 		return best;
 	}		
 
+	// ties go to the earlier spawn, the one a walk over world.agents would meet first
+	static bool is_nearer(float dist, const Pawn* b, float best_dist, const Pawn* best)
+	{
+		return dist < best_dist || (best && dist == best_dist && b->order < best->order);
+	}
+
+	bool is_skill_ready(int slot) const
+	{
+		return cooldown[slot] == 0 && skill_params[slot].type != SE_nothing;
+	}
+
+	// find_target for every ready slot in a single pass over the agents near enough for any of them
+	void find_targets()
+	{
+		std::array<float,max_skills> best_dist;
+		float reach = 0;
+		for (int slot=0; slot<max_skills; ++slot)
+		{
+			best_dist[slot] = square(skill_params[slot].range+1);
+			targets[slot] = nullptr;
+			if (is_skill_ready(slot)) reach = std::max(reach,skill_params[slot].range+1);
+		}
+		if (reach == 0) return;
+
+		world->grid.query(pos,reach,[&](Agent* a)
+		{
+			auto b = dynamic_cast<Pawn*>(a);
+			if (b == nullptr) return;
+
+			auto dist = distance_squared(pos,b->pos);
+			for (int slot=0; slot<max_skills; ++slot)
+			{
+				if (is_skill_ready(slot) && is_nearer(dist,b,best_dist[slot],targets[slot]) && can_affect(skill_params[slot].type,b))
+				{
+					best_dist[slot] = dist;
+					targets[slot] = b;
+				}
+			}
+		});
+	}
+
+	virtual void update_action_mask()
+	{
+		find_targets();
+
+		action_mask.reset();
+		for (int slot=0; slot<max_skills; ++slot)
+		{
+			action_mask[slot] = is_skill_ready(slot) && targets[slot] != nullptr;
+		}
+		for (int action=max_skills; action<num_actions; ++action)
+		{
+			action_mask[action] = Base::is_valid_action(action-max_skills);
+		}
+	}
+
 	virtual void die(Pawn* attacker)
 	{	
 		if (attacker && !attacker->pending_kill)
@@ -929,7 +1437,7 @@ public :
 	{		
 		if (action < max_skills)
 		{	
-			return cooldown[action] == 0 && skill_params[action].type != SE_nothing && find_target(action) != nullptr;
+			return is_skill_ready(action) && find_target(action) != nullptr;
 		}
 		else
 		{
@@ -982,49 +1490,56 @@ public :
 	virtual bool ping_team(int team) const { return is_friendly(team); }
 };
 
-class HeroBrain : public AgentBrain
+// everything get_frame reads from the world, a few dozen bytes per agent.
+// rasterizing it gives the same observation whether done at once or when the frame is sampled.
+struct FrameSnapshot
 {
-public:
-	HeroBrain(NetworkSp network, World* world) : AgentBrain(network,world) {}
-	virtual int forward( Actable* agent )
+	struct Entity
 	{
-		// LOG(INFO) << "hero brain forward, calling super";
-		return Brain::forward(
-			get_frame(agent),
-			[&]{return agent->random_action();},
-			[&](int action){return agent->is_valid_action(action);}
-			);
-	}
+		Vector pos;
+		float health;
+		float range;
+		int level;
+		std::array<float,max_skills> skill_pct;
+		int8_t type;
+		int8_t friendly;
+	};
 
-	SingleFrameSp get_frame(Actable* agent) const
-	{		
-		SingleFrameSp single_frame(new SingleFrame);
+	struct Mark
+	{
+		Vector location;
+		float radius;
+		int type;
+	};
+
+	Vector self_pos;
+	Vector world_size;
+	int geom;
+	std::array<float,num_stats> stats;
+	std::vector<Entity> entities;
+	std::vector<Mark> events;
 
+	// images : channels * sight_area floats, stats : num_stats floats
+	template <typename G>
+	void rasterize(float* images, float* out_stats) const
+	{
+		enum { sight_diameter = G::sight_diameter, sight_area = G::sight_area };
 		const Vector center(sight_diameter/2.0f,sight_diameter/2.0f);
 		const float grid = 1.0f;
 
-		auto& images = single_frame->images;
-
-		for (auto& image : images)
-		{
-			std::fill(image.begin(),image.end(),0);
-		}
-
-		Pawn* self = dynamic_cast<Pawn*>(agent);
+		std::fill(images, images + G::ImageSize, 0);
 
 		auto write_i = [&](int ch, int x, int y, float val)
 		{			
 			if (x >= 0 && y >= 0 && x < sight_diameter && y < sight_diameter)
 			{
-				images[ch][x + y * sight_diameter] += val;
+				images[ch * sight_area + x + y * sight_diameter] += val;
 			}
 		};
 
-		// std::cout << self->pos.x << ", " << self->pos.y << "\n";
-
 		auto write = [&](int ch, const Vector& q, float val)
 		{
-			Vector p = (q - self->pos) + center;
+			Vector p = (q - self_pos) + center;
 			auto ix = int(std::floor(p.x));
 			auto iy = int(std::floor(p.y));
 			auto fx = p.x - ix;
@@ -1033,20 +1548,14 @@ public:
 			if (fx > 0.5) ix++;
 			if (fy > 0.5) iy++;
 			write_i(ch,ix,iy,val);
-			return;
-
-			write_i(ch,ix,iy,val * (1-fx) * (1-fy));
-			write_i(ch,ix+1,iy,val * fx * (1-fy));
-			write_i(ch,ix+1,iy+1,val * fx * fy);
-			write_i(ch,ix,iy+1,val * (1-fx) * fy);
 		};
 
 		for (int y=0; y<sight_diameter; ++y)
 		{
 			for (int x=0; x<sight_diameter; ++x)
 			{
-				Vector p = Vector(x,y) + self->pos - center;
-				if (agent->world->is_solid(p))
+				Vector p = Vector(x,y) + self_pos - center;
+				if (World::is_solid(geom,world_size,p))
 				{
 					write(0,p,-2);
 				}				
@@ -1055,7 +1564,7 @@ public:
 					write(0,p,0);
 				}
 
-				for (const auto& e : agent->world->events)
+				for (const auto& e : events)
 				{
 					if (distance_squared(e.location,p) <= square(grid + e.radius))
 					{
@@ -1063,30 +1572,160 @@ public:
 					}					
 				}
 
-				for (auto other : agent->world->agents)
+				for (const auto& a : entities)
 				{
-					Pawn* a = dynamic_cast<Pawn*>(other.get());
-					if (a == nullptr || a == self) continue;
-					
-					const float power = a->skill_params[0].level * exp( -distance_squared(p,a->pos) / square(a->skill_params[0].range) );
-					write(2,p,(a->team == self->team ? 1 : -1) * power ); 
+					const float power = a.level * exp( -distance_squared(p,a.pos) / square(a.range) );
+					write(2,p,a.friendly * power ); 
 				}
 			}
 		}
 
-		for (auto other : agent->world->agents)
+		for (const auto& a : entities)
+		{
+			write(0,a.pos,a.type+1);
+			write(1,a.pos,a.health);			
+			write(4,a.pos,a.friendly); 
+			for (int i=0; i<max_skills; ++i)
+			{
+				write(5+i,a.pos,a.skill_pct[i]);
+			}
+		}		
+
+		std::copy(stats.begin(),stats.end(),out_stats);
+	}
+};
+
+template <typename G>
+struct SnapshotFrame : public SingleFrame<G>
+{
+	FrameSnapshot snapshot;
+
+	SnapshotFrame(const FrameSnapshot& snapshot) : snapshot(snapshot) { FrameAccounting::track_bytes(bytes()); }
+	~SnapshotFrame() { FrameAccounting::track_bytes(-bytes()); }
+
+	int64_t bytes() const
+	{
+		return sizeof(SnapshotFrame) + snapshot.entities.capacity() * sizeof(FrameSnapshot::Entity) + snapshot.events.capacity() * sizeof(FrameSnapshot::Mark);
+	}
+
+	virtual void write(float* images, float* stats) const
+	{
+		snapshot.rasterize<G>(images,stats);
+	}
+};
+
+template <typename G>
+class HeroBrain : public Brain<G>
+{
+public:
+	typedef typename Brain<G>::NetworkSp NetworkSp;
+	typedef typename Brain<G>::SingleFrameSp SingleFrameSp;
+	enum { sight_diameter = G::sight_diameter };
+
+	HeroBrain(NetworkSp network, World* world) : Brain<G>(network,world) {}
+	virtual int forward( Actable* agent )
+	{
+		// LOG(INFO) << "hero brain forward, calling super";
+		if (this->should_repeat(agent->action_mask))
+		{
+			return this->current_experience.action;
+		}
+
+		Metrics::count(agent->world->evaluation ? MC_eval_decisions : MC_decisions);
+		return Brain<G>::forward(
+			get_frame(agent),
+			agent->action_mask,
+			[&]{return agent->random_action();}
+			);
+	}
+
+	void capture(Actable* agent, FrameSnapshot& snapshot) const
+	{
+		Pawn* self = dynamic_cast<Pawn*>(agent);
+
+		snapshot.self_pos = self->pos;
+		snapshot.world_size = agent->world->size;
+		snapshot.geom = agent->world->geom;
+
+		// only events that can touch a cell of the sight window
+		snapshot.events.clear();
+		agent->world->events.query(self->pos,1.0f + sight_diameter * float(M_SQRT1_2),[&](const Event& e)
 		{
-			Pawn* a = dynamic_cast<Pawn*>(other.get());
-			if (a == nullptr || a == self) continue;
+			snapshot.events.push_back({e.location,e.radius,e.type});
+		});
 
-			write(0,a->pos,a->type+1);
-			write(1,a->pos,a->health);			
-			write(4,a->pos,(a->team == self->team ? 1 : -1) ); 
+		snapshot.entities.clear();
+		for (auto a : observed(self))
+		{
+			FrameSnapshot::Entity entity;
+			entity.pos = a->pos;
+			entity.health = a->health;
+			entity.range = a->skill_params[0].range;
+			entity.level = a->skill_params[0].level;
 			for (int i=0; i<max_skills; ++i)
 			{
-				write(5+i,a->pos,a->skill_pct(i));
+				entity.skill_pct[i] = a->skill_pct(i);
 			}
+			entity.type = a->type;
+			entity.friendly = a->team == self->team ? 1 : -1;
+			snapshot.entities.push_back(entity);
+		}
+
+		auto& stats = snapshot.stats;
+		stats[0] = this->world->game_state.clock / 1000.0f;
+		stats[1] = self->health;
+		stats[2] = self->type;
+		stats[3] = this->world->get_dominant_team() == self->team ? 1 : 0;
+		for (int i=0; i<max_skills; ++i)
+		{
+			stats[4+i] = self->skill_pct(i);
 		}		
+	}
+
+	// the other pawns self's frame shows, in world.agents order so the influence sums add up the same way.
+	// with --influence_cutoff only those within reach of the sight window : a pawn's own cell is at most
+	// a half diagonal and a cell away, and its influence is below the cutoff once cutoff * range beyond that.
+	const std::vector<Pawn*>& observed(Pawn* self) const
+	{
+		scratch_observed.clear();
+		if (FLAGS_influence_cutoff <= 0)
+		{
+			for (auto other : self->world->agents)
+			{
+				Pawn* a = dynamic_cast<Pawn*>(other.get());
+				if (a && a != self) scratch_observed.push_back(a);
+			}
+			return scratch_observed;
+		}
+
+		const float window = 1.0f + sight_diameter * float(M_SQRT1_2);
+		const float cutoff = FLAGS_influence_cutoff;
+		self->world->grid.query(self->pos,window + cutoff * Pawn::max_influence_range,[&](Agent* other)
+		{
+			Pawn* a = dynamic_cast<Pawn*>(other);
+			if (a && a != self && distance_squared(self->pos,a->pos) <= square(window + cutoff * a->skill_params[0].range))
+			{
+				scratch_observed.push_back(a);
+			}
+		});
+		std::sort(scratch_observed.begin(),scratch_observed.end(),[](const Pawn* a, const Pawn* b){ return a->order < b->order; });
+		return scratch_observed;
+	}
+
+	SingleFrameSp get_frame(Actable* agent) const
+	{		
+		PROFILE_SCOPE(get_frame);
+
+		capture(agent,scratch_snapshot);
+
+		if (FLAGS_lazy_frames)
+		{
+			return SingleFrameSp(new SnapshotFrame<G>(scratch_snapshot));
+		}
+
+		RasterFrame<G>* single_frame = new RasterFrame<G>;
+		auto& images = single_frame->images;
+		scratch_snapshot.rasterize<G>(images.front().data(),single_frame->stats.data());
 
 		extern bool is_keypressed(char c);
 		if (is_keypressed('d'))
@@ -1109,15 +1748,10 @@ public:
 		// if (counter++ > 10)
 		// 	exit(-1);
 
-		auto& stats = single_frame->stats;
-		stats[0] = world->game_state.clock / 1000.0f;
-		stats[1] = self->health;
-		stats[2] = self->type;
-		stats[3] = world->get_dominant_team() == self->team ? 1 : 0;
-		for (int i=0; i<max_skills; ++i)
-		{
-			stats[4+i] = self->skill_pct(i);
-		}		
-		return single_frame;
+		return SingleFrameSp(single_frame);
 	}
+
+private:
+	mutable FrameSnapshot scratch_snapshot; // scratch, keeps its capacity between ticks
+	mutable std::vector<Pawn*> scratch_observed;
 };
\ No newline at end of file
@@ -0,0 +1,57 @@
+DEFINE_int32(league_size, 0, "frozen learner snapshots kept as opponents; 0 plays the second network as before");
+DEFINE_int32(league_snapshot_interval, 100, "episodes between freezing the learner into the league");
+
+// bounded pool of the learner's past weights. each episode one snapshot is copied into the opponent,
+// an inference-only network whose parameter blobs are overwritten in place, so no solver is built and nothing is read from disk.
+// a snapshot is the parameters alone : no diffs, solver history or activations.
+template <typename Network>
+class League
+{
+public :
+	struct Snapshot
+	{
+		int epoch; // when it was frozen, -1 for the opponent's own starting weights
+		std::vector<float> params;
+	};
+
+	League(Network& learner, Network& opponent, const RandomStream& random)
+	: learner(learner), opponent(opponent), random(random),
+	  pool_gauge("league_size","opponent snapshots held"),
+	  age_gauge("league_opponent_age","episodes since the current opponent was frozen")
+	{
+		CHECK_GT(FLAGS_league_size,0);
+		CHECK_GT(FLAGS_league_snapshot_interval,0);
+		CHECK(learner.epsilon.is_learning) << "the league needs a learning network to freeze";
+
+		opponent.epsilon.is_learning = false;
+		opponent.solver.reset();
+
+		pool.push_back({-1,freeze_params(*opponent.net)});
+	}
+
+	// before each episode : freezes the learner when due, then loads a uniformly drawn snapshot into the opponent
+	void begin_episode(int epoch)
+	{
+		if (epoch > 0 && epoch % FLAGS_league_snapshot_interval == 0)
+		{
+			if (pool.size() >= FLAGS_league_size)
+			{
+				pool.pop_front();
+			}
+			pool.push_back({epoch,freeze_params(*learner.net)});
+		}
+
+		const auto& s = pool[random.randint(pool.size())];
+		thaw_params(s.params,*opponent.net);
+
+		pool_gauge.set(pool.size());
+		age_gauge.set(s.epoch < 0 ? epoch : epoch - s.epoch);
+	}
+
+private:
+	Network& learner;
+	Network& opponent;
+	RandomStream random;
+	std::deque<Snapshot> pool;
+	Metrics::Gauge pool_gauge, age_gauge;
+};
@@ -0,0 +1,120 @@
+DEFINE_double(huber_delta, 0, "clip the td error's gradient to this magnitude (huber loss); 0 keeps the squared loss");
+
+// loss on the taken action's q value only, computed straight from the q_values blob :
+// 1/2N sum (q[a] - target)^2, or its huber form, with the gradient written into q_values' diff.
+// replaces multiplying every q value by a one-hot filter and a euclidean loss against a mostly-zero target.
+class MaskedQLoss
+{
+public :
+	struct ActionTarget
+	{
+		int action;
+		float target;
+	};
+
+	template <size_t N>
+	static float compute(caffe::Blob<float>& q_values, const std::array<ActionTarget,N>& action_targets, float huber_delta)
+	{
+		assert(q_values.num() == N);
+
+		const float* q = q_values.cpu_data();
+		float* diff = q_values.mutable_cpu_diff();
+		std::fill(diff, diff + q_values.count(), 0);
+
+		float loss = 0;
+		for (int k=0; k<N; ++k)
+		{
+			const auto& at = action_targets[k];
+			const int index = q_values.offset(k) + at.action;
+			const float d = q[index] - at.target;
+
+			if (huber_delta > 0 && std::abs(d) > huber_delta)
+			{
+				loss += huber_delta * (std::abs(d) - 0.5f * huber_delta);
+				diff[index] = (d > 0 ? huber_delta : -huber_delta) / N;
+			}
+			else
+			{
+				loss += 0.5f * d * d;
+				diff[index] = d / N;
+			}
+		}
+		return loss / N;
+	}
+};
+
+// a solver for a net whose loss is computed outside it (MaskedQLoss). the trainer runs forward, the loss and backward
+// itself, possibly summing several replicas' gradients, and ApplyUpdate(loss) does the rest of what Solver::Step would :
+// testing, display, the solver's update rule, Net::Update and the iteration / snapshot bookkeeping.
+// this caffe builds layers through a fixed type switch, so the loss can't be a layer of its own.
+class ExternalLossSolver
+{
+public :
+	virtual ~ExternalLossSolver() {}
+
+	virtual void ApplyUpdate(float loss) = 0;
+
+	// the solver param names, as caffe::GetSolver would build it, with ApplyUpdate
+	static caffe::Solver<float>* create(const caffe::SolverParameter& param);
+
+	// solver must come from create
+	static ExternalLossSolver& of(caffe::Solver<float>& solver)
+	{
+		auto s = dynamic_cast<ExternalLossSolver*>(&solver);
+		CHECK(s) << "solver wasn't built by ExternalLossSolver::create";
+		return *s;
+	}
+};
+
+template <typename Base>
+class WithExternalLoss : public Base, public ExternalLossSolver
+{
+public :
+	explicit WithExternalLoss(const caffe::SolverParameter& param)
+	: Base(param), display_loss(0), display_steps(0)
+	{}
+
+	virtual void ApplyUpdate(float loss)
+	{
+		const auto& param = this->param_;
+		if (param.test_interval() && this->iter_ > 0 && this->iter_ % param.test_interval() == 0)
+		{
+			this->TestAll();
+		}
+
+		// averaged over the display interval rather than the last minibatch alone
+		display_loss += loss;
+		display_steps++;
+		if (param.display() && this->iter_ % param.display() == 0)
+		{
+			LOG(INFO) << "Iteration " << this->iter_ << ", loss = " << display_loss / display_steps;
+			display_loss = 0;
+			display_steps = 0;
+		}
+
+		this->ComputeUpdateValue();
+		this->net_->Update();
+
+		++this->iter_;
+		if (param.snapshot() && this->iter_ % param.snapshot() == 0)
+		{
+			this->Snapshot();
+		}
+	}
+
+private:
+	float display_loss;
+	int display_steps;
+};
+
+caffe::Solver<float>* ExternalLossSolver::create(const caffe::SolverParameter& param)
+{
+	switch (param.solver_type())
+	{
+	case caffe::SolverParameter_SolverType_SGD : return new WithExternalLoss<caffe::SGDSolver<float>>(param);
+	case caffe::SolverParameter_SolverType_NESTEROV : return new WithExternalLoss<caffe::NesterovSolver<float>>(param);
+	case caffe::SolverParameter_SolverType_ADAGRAD : return new WithExternalLoss<caffe::AdaGradSolver<float>>(param);
+	case caffe::SolverParameter_SolverType_ADADELTA : return new WithExternalLoss<caffe::AdaDeltaSolver<float>>(param);
+	default : LOG(FATAL) << "unknown solver type " << param.solver_type(); return nullptr;
+	}
+}
@@ -0,0 +1,142 @@
+#include <csignal>
+
+// bytes held by replay memories, live frames and each network's caffe blobs.
+// logged on SIGUSR1 and exported as memory_bytes gauges with the metrics.
+template <typename Network>
+class MemoryReport
+{
+public :
+	typedef boost::shared_ptr<Network> NetworkSp;
+
+	struct NetworkUsage
+	{
+		size_t replay, params, grads, history, activations, host_buffers;
+
+		size_t total() const { return replay + params + grads + history + activations + host_buffers; }
+	};
+
+	MemoryReport(const std::vector<NetworkSp>& networks)
+	: networks(networks),
+	  frames_gauge("memory_bytes","bytes held, by component","kind=\"frames\""),
+	  peak_frames_gauge("memory_bytes","bytes held, by component","kind=\"frames_peak\""),
+	  rss_gauge("memory_bytes","bytes held, by component","kind=\"rss\""),
+	  peak_rss_gauge("memory_bytes","bytes held, by component","kind=\"rss_peak\"")
+	{
+		for (int i=0; i<networks.size(); ++i)
+		{
+			const std::string net = str(format(",net=\"%d\"")%i);
+			for (auto kind : {"replay","params","grads","solver_history","activations","host_buffers"})
+			{
+				network_gauges.push_back(std::unique_ptr<Metrics::Gauge>(new Metrics::Gauge("memory_bytes","bytes held, by component",str(format("kind=\"%s\"%s")%kind%net))));
+			}
+		}
+
+		Metrics::instance().add_collector([this]{ update_gauges(); });
+
+		signal(SIGUSR1,[](int){ requested() = 1; });
+	}
+
+	static volatile sig_atomic_t& requested()
+	{
+		static volatile sig_atomic_t flag = 0;
+		return flag;
+	}
+
+	static NetworkUsage measure(Network& n)
+	{
+		NetworkUsage u = {};
+		const bool training = n.solver.get() != nullptr;
+
+		u.replay = n.trainer.replay_memory.bytes();
+
+		for (const auto& p : n.net->params())
+		{
+			u.params += p->count() * sizeof(float);
+		}
+		if (training)
+		{
+			u.grads = u.params;
+		}
+
+		if (auto sgd = dynamic_cast<caffe::SGDSolver<float>*>(n.solver.get()))
+		{
+			for (const auto& h : sgd->history())
+			{
+				u.history += h->count() * sizeof(float);
+			}
+		}
+
+		for (const auto& b : n.net->blobs())
+		{
+			u.activations += b->count() * sizeof(float) * (training ? 2 : 1);
+		}
+
+		// the cursors' minibatch arrays live inline in the network
+		u.host_buffers = sizeof(Network);
+		return u;
+	}
+
+	// VmRSS / VmHWM in bytes
+	static std::pair<size_t,size_t> process_rss()
+	{
+		std::ifstream status("/proc/self/status");
+		std::string line;
+		size_t rss = 0, peak = 0;
+		while (std::getline(status,line))
+		{
+			if (line.compare(0,6,"VmRSS:") == 0) rss = std::stoul(line.substr(6)) * 1024;
+			if (line.compare(0,6,"VmHWM:") == 0) peak = std::stoul(line.substr(6)) * 1024;
+		}
+		return std::make_pair(rss,peak);
+	}
+
+	void update_gauges()
+	{
+		frames_gauge.set(FrameAccounting::live_bytes());
+		peak_frames_gauge.set(FrameAccounting::peak_bytes());
+
+		const auto rss = process_rss();
+		rss_gauge.set(rss.first);
+		peak_rss_gauge.set(rss.second);
+
+		for (int i=0; i<networks.size(); ++i)
+		{
+			const auto u = measure(*networks[i]);
+			const size_t values[] = {u.replay,u.params,u.grads,u.history,u.activations,u.host_buffers};
+			for (int k=0; k<6; ++k)
+			{
+				network_gauges[i * 6 + k]->set(values[k]);
+			}
+		}
+	}
+
+	void log()
+	{
+		auto mb = [](double bytes){ return bytes / (1024 * 1024); };
+
+		LOG(INFO) << str(format("frames : %d live, %.1f MB (peak %.1f MB)")%FrameAccounting::live_frames().load()%mb(FrameAccounting::live_bytes())%mb(FrameAccounting::peak_bytes()));
+		for (int i=0; i<networks.size(); ++i)
+		{
+			const auto u = measure(*networks[i]);
+			LOG(INFO) << str(format("net %d : replay %.1f MB (%d experiences), params %.1f MB, grads %.1f MB, solver history %.1f MB, activations %.1f MB, host buffers %.1f MB, total %.1f MB")
+				%i%mb(u.replay)%networks[i]->trainer.replay_memory.count()%mb(u.params)%mb(u.grads)%mb(u.history)%mb(u.activations)%mb(u.host_buffers)%mb(u.total()));
+		}
+		const auto rss = process_rss();
+		LOG(INFO) << str(format("process : rss %.1f MB (peak %.1f MB)")%mb(rss.first)%mb(rss.second));
+	}
+
+	// called once per tick from the main loop
+	void tick()
+	{
+		if (requested())
+		{
+			requested() = 0;
+			log();
+		}
+	}
+
+private:
+	std::vector<NetworkSp> networks;
+	Metrics::Gauge frames_gauge, peak_frames_gauge, rss_gauge, peak_rss_gauge;
+	std::vector<std::unique_ptr<Metrics::Gauge>> network_gauges;
+};
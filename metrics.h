@@ -0,0 +1,210 @@
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#include <cstdio>
+#include <functional>
+
+DEFINE_string(metrics_file, "", "periodically rewrite prometheus text-format metrics to this file");
+DEFINE_int32(metrics_interval, 10, "seconds between metrics_file rewrites");
+
+enum MetricCounter
+{
+	MC_env_steps,
+	MC_decisions,
+	MC_sgd_steps,
+	MC_replay_evictions,
+	MC_episodes,
+	MC_eval_env_steps,
+	MC_eval_decisions,
+	MC_max
+};
+
+const char* metric_counter_name(int counter)
+{
+	static const char* names[MC_max] = {
+		"env_steps",
+		"decisions",
+		"sgd_steps",
+		"replay_evictions",
+		"episodes",
+		"eval_env_steps",
+		"eval_decisions"
+	};
+	return names[counter];
+}
+
+// counters are batched per thread and folded into the shared totals every flush_every events.
+// gauges are plain atomics owned by whoever reports them and registered by name.
+class Metrics
+{
+public :
+	enum { flush_every = 256 };
+
+	class Gauge
+	{
+	public :
+		Gauge(const std::string& name, const std::string& help, const std::string& labels = "")
+		: name(name), help(help), labels(labels), value(0)
+		{
+			instance().add_gauge(this);
+		}
+
+		~Gauge()
+		{
+			instance().remove_gauge(this);
+		}
+
+		void set(double v) { value.store(v,std::memory_order_relaxed); }
+		double get() const { return value.load(std::memory_order_relaxed); }
+
+		// exponential moving average; single writer
+		void smooth(double v, double alpha) { set(get() + alpha * (v - get())); }
+
+		const std::string name, help, labels;
+
+	private:
+		std::atomic<double> value;
+	};
+
+	static Metrics& instance()
+	{
+		static Metrics metrics;
+		return metrics;
+	}
+
+	static void count(MetricCounter counter, uint64_t n = 1)
+	{
+		auto& pending = local();
+		pending.counts[counter] += n;
+		if (++pending.events >= flush_every)
+		{
+			instance().flush(pending);
+		}
+	}
+
+	uint64_t total(MetricCounter counter) const
+	{
+		return totals[counter].load(std::memory_order_relaxed);
+	}
+
+	// called once per tick; rewrites metrics_file when the interval is up
+	static void tick()
+	{
+		if (FLAGS_metrics_file == "") return;
+
+		auto& m = instance();
+		const auto now = std::chrono::steady_clock::now();
+		if (now - m.last_publish >= std::chrono::seconds(FLAGS_metrics_interval))
+		{
+			m.flush(local());
+			m.publish(FLAGS_metrics_file,now);
+		}
+	}
+
+	// run before every publish, to refresh gauges that are sampled rather than pushed
+	void add_collector(std::function<void()> collector)
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		collectors.push_back(collector);
+	}
+
+	void publish(const std::string& file, std::chrono::steady_clock::time_point now)
+	{
+		std::vector<std::function<void()>> pending_collectors;
+		{
+			std::lock_guard<std::mutex> lock(mutex);
+			pending_collectors = collectors;
+		}
+		for (const auto& c : pending_collectors)
+		{
+			c();
+		}
+
+		const double seconds = std::chrono::duration<double>(now - last_publish).count();
+		last_publish = now;
+
+		// written next to the target then renamed, so scrapers never see half a file
+		const std::string tmp = file + ".tmp";
+		{
+			std::ofstream out(tmp);
+			for (int c=0; c<MC_max; ++c)
+			{
+				const auto value = total(MetricCounter(c));
+				const auto name = str(format("dqn_%s")%metric_counter_name(c));
+				out << "# TYPE " << name << "_total counter\n" << name << "_total " << value << "\n";
+				out << "# TYPE " << name << "_per_second gauge\n" << name << "_per_second " << (seconds > 0 ? (value - last_totals[c]) / seconds : 0) << "\n";
+				last_totals[c] = value;
+			}
+
+			std::lock_guard<std::mutex> lock(mutex);
+			std::string last_name;
+			for (auto g : gauges)
+			{
+				if (g->name != last_name)
+				{
+					out << "# HELP dqn_" << g->name << " " << g->help << "\n# TYPE dqn_" << g->name << " gauge\n";
+					last_name = g->name;
+				}
+				out << "dqn_" << g->name << (g->labels.empty() ? "" : "{" + g->labels + "}") << " " << g->get() << "\n";
+			}
+		}
+		std::rename(tmp.c_str(),file.c_str());
+	}
+
+private:
+	struct Pending
+	{
+		std::array<uint64_t,MC_max> counts;
+		int events;
+	};
+
+	static Pending& local()
+	{
+		static thread_local Pending pending = {{}, 0};
+		return pending;
+	}
+
+	Metrics()
+	: last_publish(std::chrono::steady_clock::now())
+	{
+		for (int c=0; c<MC_max; ++c)
+		{
+			totals[c] = 0;
+			last_totals[c] = 0;
+		}
+	}
+
+	void flush(Pending& pending)
+	{
+		for (int c=0; c<MC_max; ++c)
+		{
+			if (pending.counts[c])
+			{
+				totals[c].fetch_add(pending.counts[c],std::memory_order_relaxed);
+				pending.counts[c] = 0;
+			}
+		}
+		pending.events = 0;
+	}
+
+	void add_gauge(Gauge* g)
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		// keep same-named gauges adjacent so each family gets one TYPE line
+		auto it = std::find_if(gauges.rbegin(),gauges.rend(),[&](Gauge* o){return o->name == g->name;});
+		gauges.insert(it.base(),g);
+	}
+
+	void remove_gauge(Gauge* g)
+	{
+		std::lock_guard<std::mutex> lock(mutex);
+		gauges.erase(std::remove(gauges.begin(),gauges.end(),g),gauges.end());
+	}
+
+	std::array<std::atomic<uint64_t>,MC_max> totals;
+	std::array<uint64_t,MC_max> last_totals;
+	std::chrono::steady_clock::time_point last_publish;
+	std::mutex mutex;
+	std::vector<Gauge*> gauges;
+	std::vector<std::function<void()>> collectors;
+};
@@ -0,0 +1,449 @@
+#include <atomic>
+#include <chrono>
+#include <mutex>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#endif
+
+DEFINE_int32(profile_interval, 0, "dump hot-path latency histograms every N ticks (0 : only at exit)");
+DEFINE_string(trace_file, "", "write a chrome://tracing / Perfetto timeline of the traced ticks to this file");
+DEFINE_int32(trace_begin, 0, "tick after which tracing starts");
+DEFINE_int32(trace_ticks, 100, "number of ticks to trace");
+
+// hot-path timers. build without DQN_PROFILE and PROFILE_SCOPE compiles to nothing.
+enum ProfilePoint
+{
+	PP_tick,
+	PP_tick_expire_events,
+	PP_tick_forward,
+	PP_tick_events,
+	PP_tick_agents,
+	PP_tick_backward,
+	PP_tick_gc,
+	PP_decision,
+	PP_get_frame,
+	PP_predict,
+	PP_train_sample,
+	PP_train_gather,
+	PP_train_target_forward,
+	PP_train_solver_step,
+	PP_train_reduce,
+	PP_train_update,
+	PP_train_dataset_wait,
+	PP_display_dump,
+	PP_max
+};
+
+const char* profile_point_name(int point)
+{
+	static const char* names[PP_max] = {
+		"tick",
+		"tick.expire_events",
+		"tick.forward",
+		"tick.events",
+		"tick.agents",
+		"tick.backward",
+		"tick.gc",
+		"decision",
+		"get_frame",
+		"predict",
+		"train.sample",
+		"train.gather",
+		"train.target_forward",
+		"train.solver_step",
+		"train.reduce",
+		"train.update",
+		"train.dataset_wait",
+		"display.dump"
+	};
+	return names[point];
+}
+
+inline uint64_t read_cycles()
+{
+#if defined(__x86_64__) || defined(__i386__)
+	return __rdtsc();
+#else
+	return std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count();
+#endif
+}
+
+// log-linear buckets over cycle counts, 8 per power of two (~12% resolution), like HdrHistogram.
+class LatencyHistogram
+{
+public :
+	enum { sub_bits = 3, sub_buckets = 1 << sub_bits, num_buckets = 64 * sub_buckets };
+
+	LatencyHistogram()
+	{
+		clear();
+	}
+
+	void clear()
+	{
+		std::fill(counts.begin(),counts.end(),0);
+		total = 0;
+		sum = 0;
+		max = 0;
+	}
+
+	void record(uint64_t cycles)
+	{
+		counts[bucket_of(cycles)]++;
+		total++;
+		sum += cycles;
+		max = std::max(max,cycles);
+	}
+
+	static int bucket_of(uint64_t v)
+	{
+		if (v < sub_buckets) return v;
+
+		const int shift = 63 - __builtin_clzll(v) - sub_bits;
+		return (shift + 1) * sub_buckets + ((v >> shift) & (sub_buckets - 1));
+	}
+
+	static uint64_t lower_bound(int bucket)
+	{
+		if (bucket < sub_buckets) return bucket;
+
+		const int shift = bucket / sub_buckets - 1;
+		return uint64_t(sub_buckets + bucket % sub_buckets) << shift;
+	}
+
+	uint64_t percentile(double p) const
+	{
+		const uint64_t rank = std::max<uint64_t>(1,std::ceil(total * p));
+		uint64_t seen = 0;
+		for (int b=0; b<num_buckets; ++b)
+		{
+			seen += counts[b];
+			if (seen >= rank) return std::min(max,lower_bound(b+1));
+		}
+		return max;
+	}
+
+	uint64_t total, sum, max;
+
+private:
+	friend class ThreadHistogram;
+
+	std::array<uint64_t,num_buckets> counts;
+};
+
+// a thread's own histogram. only that thread records into it, but dumps read it meanwhile,
+// so every field is a relaxed atomic the owner updates with a plain load and store.
+class ThreadHistogram
+{
+public :
+	ThreadHistogram()
+	{
+		for (auto& c : counts) c.store(0,std::memory_order_relaxed);
+		total.store(0,std::memory_order_relaxed);
+		sum.store(0,std::memory_order_relaxed);
+		max.store(0,std::memory_order_relaxed);
+	}
+
+	void record(uint64_t cycles)
+	{
+		bump(counts[LatencyHistogram::bucket_of(cycles)],1);
+		bump(total,1);
+		bump(sum,cycles);
+		if (cycles > max.load(std::memory_order_relaxed))
+		{
+			max.store(cycles,std::memory_order_relaxed);
+		}
+	}
+
+	// adds what has been recorded so far; fields may be a record apart
+	void merge_into(LatencyHistogram& h) const
+	{
+		for (int b=0; b<LatencyHistogram::num_buckets; ++b)
+		{
+			h.counts[b] += counts[b].load(std::memory_order_relaxed);
+		}
+		h.total += total.load(std::memory_order_relaxed);
+		h.sum += sum.load(std::memory_order_relaxed);
+		h.max = std::max(h.max,max.load(std::memory_order_relaxed));
+	}
+
+private:
+	static void bump(std::atomic<uint64_t>& a, uint64_t v)
+	{
+		a.store(a.load(std::memory_order_relaxed) + v,std::memory_order_relaxed);
+	}
+
+	std::array<std::atomic<uint64_t>,LatencyHistogram::num_buckets> counts;
+	std::atomic<uint64_t> total, sum, max;
+};
+
+class Profiler
+{
+public :
+	struct ThreadProfile
+	{
+		std::array<ThreadHistogram,PP_max> histograms;
+		bool excluded = false; // guarded by the profiler's mutex
+	};
+
+	// thread-local, never freed so totals survive the thread
+	static ThreadProfile& local()
+	{
+		static thread_local ThreadProfile* profile = nullptr;
+		if (!profile)
+		{
+			profile = new ThreadProfile;
+			auto& p = instance();
+			std::lock_guard<std::mutex> lock(p.mutex);
+			p.threads.push_back(profile);
+		}
+		return *profile;
+	}
+
+	static Profiler& instance()
+	{
+		static Profiler profiler;
+		return profiler;
+	}
+
+	// leaves the calling thread's timings out of merged(), for side work such as evaluation games
+	// that would otherwise read as training throughput
+	static void exclude_thread()
+	{
+		auto& profile = local();
+		auto& p = instance();
+		std::lock_guard<std::mutex> lock(p.mutex);
+		profile.excluded = true;
+	}
+
+	static void tick(int clock)
+	{
+#ifdef DQN_PROFILE
+		if (FLAGS_profile_interval > 0 && clock % FLAGS_profile_interval == 0)
+		{
+			instance().dump();
+		}
+#endif
+	}
+
+	// cycles are converted with the rate observed since startup, no calibration loop
+	double ns_per_cycle() const
+	{
+		const auto cycles = read_cycles() - start_cycles;
+		const auto ns = std::chrono::duration<double,std::nano>(std::chrono::steady_clock::now() - start_time).count();
+		return cycles ? ns / cycles : 1.0;
+	}
+
+	// merges every thread's histograms; other threads keep writing meanwhile, so figures are approximate
+	std::array<LatencyHistogram,PP_max> merged()
+	{
+		std::array<LatencyHistogram,PP_max> result;
+		std::lock_guard<std::mutex> lock(mutex);
+		for (auto t : threads)
+		{
+			if (t->excluded) continue;
+			for (int point=0; point<PP_max; ++point)
+			{
+				t->histograms[point].merge_into(result[point]);
+			}
+		}
+		return result;
+	}
+
+	void dump()
+	{
+#ifdef DQN_PROFILE
+		const auto histograms = merged();
+		const double us = ns_per_cycle() / 1000;
+
+		LOG(INFO) << str(format("%-22s %10s %10s %10s %10s %10s %10s %10s")%"phase (us)"%"count"%"mean"%"p50"%"p90"%"p99"%"max"%"total(ms)");
+		for (int point=0; point<PP_max; ++point)
+		{
+			const auto& h = histograms[point];
+			if (!h.total) continue;
+
+			LOG(INFO) << str(format("%-22s %10d %10.2f %10.2f %10.2f %10.2f %10.2f %10.1f")
+				%profile_point_name(point)%h.total%(us * h.sum / h.total)
+				%(us * h.percentile(0.5))%(us * h.percentile(0.9))%(us * h.percentile(0.99))%(us * h.max)
+				%(us * h.sum / 1000));
+		}
+#endif
+	}
+
+private:
+	Profiler()
+	: start_cycles(read_cycles()), start_time(std::chrono::steady_clock::now())
+	{}
+
+	uint64_t start_cycles;
+	std::chrono::steady_clock::time_point start_time;
+	std::mutex mutex;
+	std::vector<ThreadProfile*> threads;
+};
+
+// begin/end spans for a bounded window of ticks, written as chrome trace json.
+// each thread appends to its own fixed buffer; the writer only reads spans published before the window closed.
+class Tracer
+{
+public :
+	enum { capacity = 1 << 16 };
+
+	struct Span
+	{
+		uint64_t begin, end;
+		int point;
+	};
+
+	struct ThreadBuffer
+	{
+		int tid;
+		std::atomic<int> count;
+		std::atomic<int> dropped; // relaxed : only totalled for the log
+		std::array<Span,capacity> spans;
+	};
+
+	static bool enabled()
+	{
+		return instance().active.load(std::memory_order_relaxed);
+	}
+
+	static void record(ProfilePoint point, uint64_t begin, uint64_t end)
+	{
+		auto& buffer = local();
+		const int n = buffer.count.load(std::memory_order_relaxed);
+		if (n < capacity)
+		{
+			buffer.spans[n] = Span{begin,end,point};
+			buffer.count.store(n+1,std::memory_order_release);
+		}
+		else
+		{
+			buffer.dropped.store(buffer.dropped.load(std::memory_order_relaxed) + 1,std::memory_order_relaxed);
+		}
+	}
+
+	static void tick(int clock)
+	{
+		if (FLAGS_trace_file == "") return;
+
+		auto& t = instance();
+		if (!t.started && clock >= FLAGS_trace_begin)
+		{
+			LOG(INFO) << "tracing " << FLAGS_trace_ticks << " ticks";
+			t.started = true;
+			t.active = true;
+		}
+		else if (t.active && clock >= FLAGS_trace_begin + FLAGS_trace_ticks)
+		{
+			t.active = false;
+			t.write(FLAGS_trace_file);
+		}
+	}
+
+	// at the end of a run : a window still open, cut short by quitting or the last tick, is written as far as it got
+	static void finish()
+	{
+		if (FLAGS_trace_file == "") return;
+
+		auto& t = instance();
+		if (t.active)
+		{
+			LOG(INFO) << "run ended inside the trace window";
+			t.active = false;
+			t.write(FLAGS_trace_file);
+		}
+	}
+
+	void write(const std::string& file)
+	{
+		std::ofstream out(file);
+		CHECK(out) << "couldn't open " << file;
+
+		const double us = Profiler::instance().ns_per_cycle() / 1000;
+		const uint64_t origin = start_cycles;
+
+		std::lock_guard<std::mutex> lock(mutex);
+		out << "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[";
+		bool first = true;
+		int total = 0, dropped = 0;
+		for (auto b : buffers)
+		{
+			const int n = b->count.load(std::memory_order_acquire);
+			for (int i=0; i<n; ++i)
+			{
+				const auto& s = b->spans[i];
+				out << (first ? "" : ",") << "\n" << str(format("{\"name\":\"%s\",\"ph\":\"X\",\"pid\":0,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f}")
+					%profile_point_name(s.point)%b->tid%(us * (s.begin - origin))%(us * (s.end - s.begin)));
+				first = false;
+			}
+			total += n;
+			dropped += b->dropped.load(std::memory_order_relaxed);
+		}
+		out << "\n]}\n";
+
+		LOG(INFO) << "wrote " << total << " spans to " << file << (dropped ? str(format(" (%d dropped, buffers full)")%dropped) : "");
+	}
+
+private:
+	Tracer()
+	: active(false), started(false), start_cycles(read_cycles())
+	{}
+
+	static Tracer& instance()
+	{
+		static Tracer tracer;
+		return tracer;
+	}
+
+	static ThreadBuffer& local()
+	{
+		static thread_local ThreadBuffer* buffer = nullptr;
+		if (!buffer)
+		{
+			auto& t = instance();
+			buffer = new ThreadBuffer;
+			buffer->count = 0;
+			buffer->dropped = 0;
+
+			std::lock_guard<std::mutex> lock(t.mutex);
+			buffer->tid = t.buffers.size();
+			t.buffers.push_back(buffer);
+		}
+		return *buffer;
+	}
+
+	std::atomic<bool> active;
+	bool started;
+	uint64_t start_cycles;
+	std::mutex mutex;
+	std::vector<ThreadBuffer*> buffers;
+};
+
+class ProfileScope
+{
+public :
+	ProfileScope(ProfilePoint point)
+	: point(point), start(read_cycles())
+	{}
+
+	~ProfileScope()
+	{
+		const auto end = read_cycles();
+		Profiler::local().histograms[point].record(end - start);
+
+		if (Tracer::enabled())
+		{
+			Tracer::record(point,start,end);
+		}
+	}
+
+private:
+	ProfilePoint point;
+	uint64_t start;
+};
+
+#ifdef DQN_PROFILE
+#define PROFILE_SCOPE(point) ProfileScope profile_scope_##point(PP_##point)
+#else
+#define PROFILE_SCOPE(point)
+#endif
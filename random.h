@@ -0,0 +1,171 @@
+#include <array>
+#include <cstdint>
+
+// counter-based generator : philox4x32-10 (Salmon et al., "Parallel random numbers: as easy as 1, 2, 3").
+// a draw is a pure function of (key, counter), so streams never share state and
+// what a stream yields does not depend on which thread asks or when.
+struct Philox4x32
+{
+	typedef std::array<uint32_t,4> Counter;
+	typedef std::array<uint32_t,2> Key;
+
+	static Counter generate(Counter ctr, Key key)
+	{
+		for (int round=0; round<10; ++round)
+		{
+			if (round)
+			{
+				key[0] += 0x9E3779B9;
+				key[1] += 0xBB67AE85;
+			}
+			const uint64_t p0 = uint64_t(0xD2511F53) * ctr[0];
+			const uint64_t p1 = uint64_t(0xCD9E8D57) * ctr[2];
+			ctr = {{
+				uint32_t(p1 >> 32) ^ ctr[1] ^ key[0],
+				uint32_t(p1),
+				uint32_t(p0 >> 32) ^ ctr[3] ^ key[1],
+				uint32_t(p0)
+			}};
+		}
+		return ctr;
+	}
+
+	// the known-answer vectors Random123 ships (kat_vectors, philox4x32 10); an edit to the rounds above
+	// would change every seeded trajectory, so runs check these before drawing anything
+	static bool passes_known_answers()
+	{
+		struct KnownAnswer { Counter ctr; Key key; Counter out; };
+		static const KnownAnswer vectors[] = {
+			{{{0x00000000,0x00000000,0x00000000,0x00000000}},{{0x00000000,0x00000000}},{{0x6627e8d5,0xe169c58d,0xbc57ac4c,0x9b00dbd8}}},
+			{{{0xffffffff,0xffffffff,0xffffffff,0xffffffff}},{{0xffffffff,0xffffffff}},{{0x408f276d,0x41c83b0e,0xa20bc7c6,0x6d5451fd}}},
+			{{{0x243f6a88,0x85a308d3,0x13198a2e,0x03707344}},{{0xa4093822,0x299f31d0}},{{0xd16cfe09,0x94fdcceb,0x5001e420,0x24126ea1}}}
+		};
+		for (const auto& v : vectors)
+		{
+			if (generate(v.ctr,v.key) != v.out) return false;
+		}
+		return true;
+	}
+};
+
+// top-level streams forked from a run's seed
+enum { RS_worlds, RS_learners, RS_league, RS_eval, RS_dataset };
+
+// one independent stream : the seed is the key, (block, stream id) the counter.
+// children are forked by id (world by epoch, agent by spawn order, learner by index) instead of being drawn from a parent,
+// so adding draws to one stream never shifts another.
+class RandomStream
+{
+public :
+	typedef uint32_t result_type;
+
+	RandomStream(uint64_t seed = 0, uint64_t stream = 0)
+	: seed(seed), stream(stream), block(0), used(4)
+	{}
+
+	static constexpr result_type min() { return 0; }
+	static constexpr result_type max() { return UINT32_MAX; }
+
+	result_type operator()()
+	{
+		if (used == 4)
+		{
+			buffer = next_block();
+			used = 0;
+		}
+		return buffer[used++];
+	}
+
+	// RandomStream(get_seed(), get_stream()) restarts this stream from its first draw
+	uint64_t get_seed() const { return seed; }
+	uint64_t get_stream() const { return stream; }
+
+	RandomStream fork(uint64_t id) const
+	{
+		return RandomStream(seed,mix(stream + 0x9E3779B97F4A7C15ull * (id + 1)));
+	}
+
+	// [0,1)
+	float uniform()
+	{
+		return to_unit((*this)());
+	}
+
+	bool test_prob(float prob)
+	{
+		return uniform() < prob;
+	}
+
+	// [0,N), unbiased (Lemire's multiply with rejection)
+	int randint(int N)
+	{
+		assert(N > 0);
+		uint64_t m = uint64_t((*this)()) * uint32_t(N);
+		if (uint32_t(m) < uint32_t(N))
+		{
+			const uint32_t threshold = uint32_t(-uint32_t(N)) % uint32_t(N);
+			while (uint32_t(m) < threshold)
+			{
+				m = uint64_t((*this)()) * uint32_t(N);
+			}
+		}
+		return int(m >> 32);
+	}
+
+	// batched draws go a whole block at a time, skipping the per-draw buffer
+	void fill_uniform(float* out, size_t n, float lo = 0, float hi = 1)
+	{
+		const float scale = hi - lo;
+		size_t i = 0;
+		for (; used < 4 && i < n; ++i)
+		{
+			out[i] = lo + scale * uniform();
+		}
+		for (; i + 4 <= n; i += 4)
+		{
+			const auto r = next_block();
+			for (int k=0; k<4; ++k)
+			{
+				out[i+k] = lo + scale * to_unit(r[k]);
+			}
+		}
+		for (; i < n; ++i)
+		{
+			out[i] = lo + scale * uniform();
+		}
+	}
+
+	void fill_randint(int* out, size_t n, int N)
+	{
+		for (size_t i=0; i<n; ++i)
+		{
+			out[i] = randint(N);
+		}
+	}
+
+private:
+	static float to_unit(uint32_t bits)
+	{
+		return (bits >> 8) * (1.0f / 16777216);
+	}
+
+	// splitmix64 finalizer, spreads fork ids over the stream space
+	static uint64_t mix(uint64_t x)
+	{
+		x = (x ^ (x >> 30)) * 0xBF58476D1CE4E5B9ull;
+		x = (x ^ (x >> 27)) * 0x94D049BB133111EBull;
+		return x ^ (x >> 31);
+	}
+
+	Philox4x32::Counter next_block()
+	{
+		const Philox4x32::Counter ctr = {{uint32_t(block), uint32_t(block >> 32), uint32_t(stream), uint32_t(stream >> 32)}};
+		const Philox4x32::Key key = {{uint32_t(seed), uint32_t(seed >> 32)}};
+		block++;
+		return Philox4x32::generate(ctr,key);
+	}
+
+	uint64_t seed, stream, block;
+	Philox4x32::Counter buffer;
+	int used;
+};
@@ -0,0 +1,203 @@
+#include <zlib.h>
+
+DEFINE_string(record_file, "", "append every episode to this file as its world stream and decisions; view with --replay_file");
+
+// one episode in a record file : this header, then compressed_size bytes of the zlib-compressed action tape.
+// the world stream, scenario and map size rebuild the starting world, and the tape supplies every decision after it.
+struct EpisodeRecordHeader
+{
+	enum { magic_value = 0x43455244, current_version = 1 };
+
+	uint32_t magic;
+	uint32_t version;
+	uint64_t seed;
+	uint64_t stream;
+	char scenario[24];
+	int32_t world_size;
+	int32_t epoch;
+	int32_t ticks;
+	int32_t final_winner;
+	uint32_t num_actions;
+	uint32_t compressed_size;
+};
+
+// appends each episode of a run to one file, a byte per decision before compression
+class EpisodeRecorder
+{
+public :
+	EpisodeRecorder(const std::string& file, const Scenario& scenario)
+	: out(file, std::ios::binary | std::ios::app), scenario(scenario)
+	{
+		CHECK(out) << "couldn't open " << file;
+		CHECK_LT(scenario.name.size(),sizeof(EpisodeRecordHeader::scenario)) << "scenario name too long to record";
+	}
+
+	// once the episode's world is populated, before its first tick
+	void begin(World& w)
+	{
+		tape.actions.clear();
+		w.tape = &tape;
+	}
+
+	// episodes cut short by quitting are written too; they replay up to where they stopped
+	void end(World& w, int epoch)
+	{
+		w.tape = nullptr;
+
+		auto header = describe(w,scenario,epoch,tape);
+
+		uLongf size = compressBound(tape.actions.size());
+		compressed.resize(size);
+		const int status = compress2(compressed.data(),&size,tape.actions.data(),tape.actions.size(),Z_BEST_COMPRESSION);
+		CHECK_EQ(status,Z_OK);
+		header.compressed_size = size;
+
+		out.write(reinterpret_cast<const char*>(&header),sizeof(header));
+		out.write(reinterpret_cast<const char*>(compressed.data()),size);
+		out.flush();
+		CHECK(out) << "failed writing an episode record";
+	}
+
+	static EpisodeRecordHeader describe(const World& w, const Scenario& scenario, int epoch, const ActionTape& tape)
+	{
+		EpisodeRecordHeader h;
+		std::memset(&h,0,sizeof(h));
+		h.magic = EpisodeRecordHeader::magic_value;
+		h.version = EpisodeRecordHeader::current_version;
+		h.seed = w.episode_random.get_seed();
+		h.stream = w.episode_random.get_stream();
+		std::strncpy(h.scenario,scenario.name.c_str(),sizeof(h.scenario)-1);
+		h.world_size = w.size.x;
+		h.epoch = epoch;
+		h.ticks = w.world_clock;
+		h.final_winner = w.final_winner;
+		h.num_actions = tape.actions.size();
+		return h;
+	}
+
+private:
+	std::ofstream out;
+	const Scenario& scenario;
+	ActionTape tape;
+	std::vector<Bytef> compressed;
+};
+
+// index of a record file; tapes are read and inflated on demand
+class EpisodeLog
+{
+public :
+	struct Entry
+	{
+		EpisodeRecordHeader header;
+		std::streamoff offset; // of the compressed tape
+	};
+
+	std::vector<Entry> entries;
+
+	EpisodeLog(const std::string& file)
+	: in(file, std::ios::binary)
+	{
+		CHECK(in) << "couldn't open " << file;
+
+		in.seekg(0,std::ios::end);
+		const std::streamoff size = in.tellg();
+		in.seekg(0);
+
+		EpisodeRecordHeader h;
+		while (in.read(reinterpret_cast<char*>(&h),sizeof(h)))
+		{
+			CHECK(h.magic == EpisodeRecordHeader::magic_value) << file << " is not an episode record file";
+			CHECK(h.version == EpisodeRecordHeader::current_version) << file << " has version " << h.version;
+
+			const std::streamoff offset = in.tellg();
+			if (offset + h.compressed_size > size)
+			{
+				LOG(WARNING) << file << " ends in a truncated episode, ignored";
+				break;
+			}
+			entries.push_back({h,offset});
+			in.seekg(h.compressed_size,std::ios::cur);
+		}
+	}
+
+	ActionTape tape(int index)
+	{
+		const auto& e = entries.at(index);
+
+		std::vector<Bytef> compressed(e.header.compressed_size);
+		in.clear();
+		in.seekg(e.offset);
+		in.read(reinterpret_cast<char*>(compressed.data()),compressed.size());
+		CHECK(in) << "couldn't read episode " << index;
+
+		ActionTape t;
+		t.actions.resize(e.header.num_actions);
+		uLongf size = t.actions.size();
+		const int status = uncompress(t.actions.data(),&size,compressed.data(),compressed.size());
+		CHECK_EQ(status,Z_OK) << "episode " << index << " is corrupt";
+		CHECK_EQ(size,t.actions.size());
+		t.replaying = true;
+		return t;
+	}
+
+private:
+	std::ifstream in;
+};
+
+// re-simulates a recorded episode : the world restarts from the recorded stream exactly as EpisodeScheduler starts one,
+// and every decision comes from the tape, so no network runs and a tick costs only the game logic.
+class EpisodeReplay
+{
+public :
+	EpisodeRecordHeader header;
+	ActionTape tape;
+	GameState game_state;
+	World world;
+
+	EpisodeReplay(const EpisodeRecordHeader& header, const ActionTape& tape)
+	: header(header), tape(tape), world(start(header),game_state,header.world_size)
+	{
+		restart();
+	}
+
+	// back to before the first tick
+	void restart()
+	{
+		tape.cursor = 0;
+		tape.replaying = true;
+		world.reset(start(header));
+		world.tape = &tape;
+		spawn_scenario(world,find_scenario(header.scenario),[](Pawn* pawn){ pawn->brain.reset(); });
+	}
+
+	// one tick; false once the recording is over
+	bool step()
+	{
+		if (world.quit || tape.at_end()) return false;
+
+		world.tick();
+		return true;
+	}
+
+	// re-simulates up to tick, from the start if it lies behind
+	void seek(int tick)
+	{
+		if (tick < world.world_clock) restart();
+
+		while (world.world_clock < tick && step())
+		{
+		}
+	}
+
+	// after stepping to the end : the re-simulation ended where the recorded episode did
+	bool matches_record() const
+	{
+		return tape.at_end() && world.world_clock == header.ticks && world.final_winner == header.final_winner;
+	}
+
+private:
+	static RandomStream start(const EpisodeRecordHeader& h)
+	{
+		return RandomStream(h.seed,h.stream);
+	}
+};
@@ -0,0 +1,216 @@
+DEFINE_string(scenario, "duel", "named spawn list every episode starts from (duel, mirror, skirmish, crowd)");
+
+// what an episode starts with; every spawn is count pawns driven by their team's network.
+// the map is world_size across, or --world_size when that is 0; the sight window doesn't depend on it.
+struct Scenario
+{
+	struct Spawn
+	{
+		int team;
+		PawnType type;
+		int count;
+
+		Spawn(int team, PawnType type, int count = 1) : team(team), type(type), count(count) {}
+	};
+
+	std::string name;
+	std::vector<Spawn> spawns;
+	int world_size;
+	int spawn_rows; // each team spawns on this many rows, going out from the middle
+
+	Scenario(const std::string& name, const std::vector<Spawn>& spawns, int world_size = 0, int spawn_rows = 1)
+	: name(name), spawns(spawns), world_size(world_size), spawn_rows(spawn_rows)
+	{}
+
+	int map_size() const
+	{
+		return world_size > 0 ? world_size : FLAGS_world_size;
+	}
+
+	int num_pawns() const
+	{
+		int n = 0;
+		for (const auto& s : spawns)
+		{
+			n += s.count;
+		}
+		return n;
+	}
+};
+
+const std::vector<Scenario>& scenarios()
+{
+	static const std::vector<Scenario> all = {
+		{"duel", {{0,PT_hero},{1,PT_hero}}},
+		{"mirror", {{0,PT_hero2},{1,PT_hero2}}},
+		{"skirmish", {{0,PT_hero},{0,PT_minion},{0,PT_minion},{1,PT_hero},{1,PT_minion2},{1,PT_minion2}}},
+		// 504 pawns on a 64 map : the crowded case, and the one bench_dqn times
+		{"crowd", {{0,PT_hero,6},{0,PT_hero2,6},{0,PT_minion,120},{0,PT_minion2,120},
+		           {1,PT_hero,6},{1,PT_hero2,6},{1,PT_minion,120},{1,PT_minion2,120}}, 64, 8}
+	};
+	return all;
+}
+
+const Scenario& find_scenario(const std::string& name)
+{
+	for (const auto& s : scenarios())
+	{
+		if (s.name == name) return s;
+	}
+	LOG(FATAL) << "unknown scenario " << name;
+	exit(-1);
+}
+
+Agent* new_pawn(PawnType type, int team)
+{
+	switch (type)
+	{
+	case PT_minion : return new Minion(team);
+	case PT_minion2 : return new Minion2(team);
+	case PT_hero2 : return new Hero2(team);
+	case PT_hero : return new Hero(team);
+	default : LOG(FATAL) << "bad pawn type " << type; exit(-1);
+	}
+}
+
+// spawns each pawn at a vacant point on one of its team's rows, team 0 from the middle row up and team 1 from
+// the one below down; all randomness comes from the world's stream.
+// pawns left in the world's pool by an earlier episode are reused, and attach(pawn) sets up each one's brain.
+template <typename Attach>
+void spawn_scenario(World& w, const Scenario& scenario, Attach attach)
+{
+	CHECK(scenario.world_size == 0 || int(w.size.x) == scenario.world_size) << "scenario " << scenario.name << " is for another map size";
+	CHECK_LE(2 * scenario.spawn_rows,int(w.size.y)) << "scenario " << scenario.name << " has more spawn rows than the map";
+
+	for (const auto& s : scenario.spawns)
+	{
+		for (int i=0; i<s.count; ++i)
+		{
+			auto pawn = static_cast<Pawn*>(w.spawn_pooled(
+				[&](Agent* a){auto p = dynamic_cast<Pawn*>(a); return p && p->type == s.type && p->team == s.team;},
+				[&]{return new_pawn(s.type,s.team);}));
+
+			attach(pawn);
+
+			for (int trial=0;;trial++)
+			{
+				CHECK_LT(trial,1000) << "Couldn't find a valid spawn-point";
+
+				const int x = w.randint(w.size.x);
+				const int depth = scenario.spawn_rows > 1 ? w.randint(scenario.spawn_rows) : 0;
+				auto pos = Vector(x,s.team + w.size.y / 2 + (s.team == 0 ? -depth : depth));
+				if (w.is_vacant(pos))
+				{
+					w.place(pawn,pos);
+					break;
+				}
+			}
+		}
+	}
+}
+
+// spawn_scenario with each pawn driven by network_for(team), the shared_ptr to the DeepNetwork driving that team,
+// whose geometry picks the brain type. pooled pawns keep their brains; a null network leaves them brainless, acting at random.
+template <typename NetworkFor>
+void populate(World& w, const Scenario& scenario, NetworkFor network_for)
+{
+	typedef typename decltype(network_for(0))::element_type Network;
+	typedef HeroBrain<typename Network::Geometry> TeamBrain;
+
+	spawn_scenario(w,scenario,[&](Pawn* pawn)
+	{
+		auto network = network_for(pawn->team);
+		if (!network)
+		{
+			pawn->brain.reset();
+		}
+		else if (auto brain = dynamic_cast<TeamBrain*>(pawn->brain.get()))
+		{
+			brain->network = network;
+		}
+		else
+		{
+			pawn->brain.reset(new TeamBrain(network,&w));
+		}
+	});
+}
+
+// one world for the whole run; each episode recycles it instead of building a new one
+class EpisodeScheduler
+{
+public :
+	EpisodeScheduler(const RandomStream& random, GameState& game_state, const Scenario& scenario)
+	: random(random), game_state(game_state), scenario(scenario), world(stream(),game_state,scenario.map_size())
+	{}
+
+	// the world for game_state.epoch, populated and ready to tick
+	template <typename NetworkFor>
+	World& next(NetworkFor network_for)
+	{
+		world.reset(stream());
+		populate(world,scenario,network_for);
+		return world;
+	}
+
+private:
+	RandomStream stream() const
+	{
+		return random.fork(RS_worlds).fork(game_state.epoch);
+	}
+
+	RandomStream random;
+	GameState& game_state;
+	const Scenario& scenario;
+	World world;
+};
+
+// fnv-1a over raw bytes; floats go in by bit pattern so any numeric drift changes the sum
+struct Checksum
+{
+	uint64_t value;
+
+	Checksum() : value(14695981039346656037ull) {}
+
+	void add_bytes(const void* data, size_t size)
+	{
+		auto p = static_cast<const unsigned char*>(data);
+		for (size_t i=0; i<size; ++i)
+		{
+			value = (value ^ p[i]) * 1099511628211ull;
+		}
+	}
+
+	template <typename T>
+	void add(const T& v)
+	{
+		add_bytes(&v,sizeof(v));
+	}
+
+	// positions, actions and health of everything alive this tick
+	void add(const World& w)
+	{
+		add(w.world_clock);
+		for (auto a : w.agents)
+		{
+			add(a->pos.x);
+			add(a->pos.y);
+			if (auto actable = dynamic_cast<const Actable*>(a.get()))
+			{
+				add(actable->action);
+				add(actable->acc_reward);
+			}
+			if (auto pawn = dynamic_cast<const Pawn*>(a.get()))
+			{
+				add(pawn->health);
+			}
+		}
+	}
+
+	void add(Net<float>& net)
+	{
+		for (const auto& p : net.params())
+		{
+			add_bytes(p->cpu_data(),p->count() * sizeof(float));
+		}
+	}
+};
@@ -1,6 +1,52 @@
-struct SingleFrame
+#include <atomic>
+
+// process-wide frame accounting, shared by every geometry; subclasses report their payload with track_bytes
+struct FrameAccounting
 {
-	typedef std::array<float,sight_area> Image;
-	std::array<Image,channels> images;
-	std::array<float,num_stats> stats;
+	FrameAccounting() { live_frames()++; }
+	virtual ~FrameAccounting() { live_frames()--; }
+
+	static std::atomic<int64_t>& live_frames() { static std::atomic<int64_t> n(0); return n; }
+	static std::atomic<int64_t>& live_bytes() { static std::atomic<int64_t> n(0); return n; }
+	static std::atomic<int64_t>& peak_bytes() { static std::atomic<int64_t> n(0); return n; }
+
+	static void track_bytes(int64_t delta)
+	{
+		const int64_t now = live_bytes().fetch_add(delta,std::memory_order_relaxed) + delta;
+		int64_t peak = peak_bytes().load(std::memory_order_relaxed);
+		while (now > peak && !peak_bytes().compare_exchange_weak(peak,now,std::memory_order_relaxed))
+		{
+		}
+	}
+};
+
+template <typename G>
+struct SingleFrame : public FrameAccounting
+{
+	typedef std::array<float,G::sight_area> Image;
+	typedef std::array<Image,channels> Images;
+	typedef std::array<float,num_stats> Stats;
+
+	// images : channels * sight_area floats, stats : num_stats floats
+	virtual void write(float* images, float* stats) const = 0;
+};
+
+// observation rasterized when it was taken
+template <typename G>
+struct RasterFrame : public SingleFrame<G>
+{
+	typename SingleFrame<G>::Images images;
+	typename SingleFrame<G>::Stats stats;
+
+	RasterFrame() { FrameAccounting::track_bytes(sizeof(RasterFrame)); }
+	~RasterFrame() { FrameAccounting::track_bytes(-int64_t(sizeof(RasterFrame))); }
+
+	virtual void write(float* out_images, float* out_stats) const
+	{
+		for (const auto& image : images)
+		{
+			out_images = std::copy(image.begin(),image.end(),out_images);
+		}
+		std::copy(stats.begin(),stats.end(),out_stats);
+	}
 };
\ No newline at end of file
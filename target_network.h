@@ -0,0 +1,283 @@
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+DEFINE_int32(target_update_interval, 0, "sgd steps between copies of the learner into a frozen target network that values next states; 0 lets the learner value them itself");
+DEFINE_bool(target_cache, true, "with --target_update_interval, value replay memory's next states in the background and reuse them until the next copy");
+DEFINE_int32(target_fill_minibatches, 8, "minibatches of next states the target cache filler collects and values per pass");
+
+// a frozen copy of the learner giving the max q of next states. since it only changes every target_update_interval steps,
+// its values are cached per replay slot : a filler thread values the slots replay memory reports written, and after
+// each refresh sweeps them all again, with its own copy of the net; a training step only forwards the next states of
+// slots the filler hasn't reached. a cached value holds while its slot's stamp and the target's version are the ones
+// it was computed with.
+template <typename Network>
+class TargetNetwork
+{
+public :
+	typedef typename Network::Experience Experience;
+	typedef typename Network::InputFrames InputFrames;
+	typedef typename Network::ReplayMemory ReplayMemory;
+	enum { MinibatchSize = Network::MinibatchSize };
+	typedef std::array<Policy,MinibatchSize> Values;
+
+	TargetNetwork(Network& learner)
+	: learner(learner), memory(learner.trainer.replay_memory), sweep(0), version(0), steps(0), stopping(false),
+	  hits("target_cache_hit_rate","moving average of next states valued from the target cache")
+	{
+		CHECK_GT(FLAGS_target_update_interval,0);
+
+		target = inference_network<Network>(learner.env);
+		if (FLAGS_target_cache)
+		{
+			CHECK(Caffe::mode() == Caffe::CPU) << "the target cache fills on cpu only";
+			CHECK_GT(FLAGS_target_fill_minibatches,0);
+			filler_net = inference_network<Network>(learner.env);
+			share_params(*target->net,*filler_net->net);
+
+			filler_windows.resize(FLAGS_target_fill_minibatches);
+			filler_indices.resize(FLAGS_target_fill_minibatches * MinibatchSize);
+			filler_stamps.resize(filler_indices.size());
+			filler_values.resize(filler_indices.size());
+
+			std::lock_guard<std::mutex> lock(memory.mutex);
+			memory.written = &dirty;
+		}
+		refresh();
+
+		if (FLAGS_target_cache)
+		{
+			filler = std::thread([this]{ fill(); });
+		}
+	}
+
+	~TargetNetwork()
+	{
+		{
+			std::lock_guard<std::mutex> lock(params_mutex);
+			stopping = true;
+		}
+		refreshed.notify_all();
+		if (filler.joinable()) filler.join();
+
+		std::lock_guard<std::mutex> lock(memory.mutex);
+		memory.written = nullptr;
+	}
+
+	// after every update of the learner
+	void tick()
+	{
+		if (++steps % FLAGS_target_update_interval == 0)
+		{
+			refresh();
+		}
+	}
+
+	// the target's max q for each sample's next state, from the cache where it can
+	const Values& evaluate(const std::array<const Experience*,MinibatchSize>& samples)
+	{
+		std::array<int,MinibatchSize> misses;
+		int num_misses = 0, num_cached = 0;
+		{
+			std::lock_guard<std::mutex> lock(memory.mutex);
+			for (int k=0; k<MinibatchSize; ++k)
+			{
+				values[k] = Policy(nullptr);
+				const auto& e = *samples[k];
+				if (!e.next_frame) continue;
+
+				const int index = memory.index_of(&e);
+				if (index >= 0 && index < cache.size() && is_cached(index))
+				{
+					values[k].val = cache[index].val;
+					num_cached++;
+				}
+				else
+				{
+					misses[num_misses++] = k;
+				}
+			}
+		}
+
+		if (num_cached + num_misses > 0)
+		{
+			hits.smooth(double(num_cached) / (num_cached + num_misses),0.01);
+		}
+		if (num_misses == 0) return values;
+
+		// the target doesn't change under the calling thread, which is the one refreshing it
+		for (int i=0; i<MinibatchSize; ++i)
+		{
+			if (i < num_misses)
+			{
+				samples[misses[i]]->next_window(windows[i]);
+			}
+			else
+			{
+				windows[i] = InputFrames();
+			}
+		}
+		const auto& policies = target->eval_for_train.evaluate(windows,ActionMask().set());
+
+		std::lock_guard<std::mutex> lock(memory.mutex);
+		for (int i=0; i<num_misses; ++i)
+		{
+			const int k = misses[i];
+			values[k].val = policies[i].val;
+			store(memory.index_of(samples[k]),policies[i].val,version);
+		}
+		return values;
+	}
+
+private:
+	struct Entry
+	{
+		float val;
+		int version; // -1 until computed
+		uint32_t stamp; // of the slot when it was
+	};
+
+	// copies the learner in; every cached value goes stale with the version, so the filler sweeps every slot again
+	// and the slots queued so far need no separate visit
+	void refresh()
+	{
+		std::lock_guard<std::mutex> lock(params_mutex);
+		thaw_params(freeze_params(*learner.net),*target->net);
+		version++;
+		{
+			std::lock_guard<std::mutex> memory_lock(memory.mutex);
+			dirty.clear();
+			sweep = 0;
+		}
+		refreshed.notify_all();
+	}
+
+	// memory.mutex held
+	bool is_cached(int index) const
+	{
+		const auto& c = cache[index];
+		return c.version == version && c.stamp == memory.stamp(index);
+	}
+
+	// memory.mutex held
+	void store(int index, float val, int computed_with)
+	{
+		if (index < 0) return;
+		if (cache.size() <= index)
+		{
+			cache.resize(memory.count(),Entry{0,-1,0});
+		}
+		cache[index] = {val,computed_with,memory.stamp(index)};
+	}
+
+	// the filler : takes written slots first, then the sweep's, a minibatch of slots looked at per hold of memory.mutex,
+	// until target_fill_minibatches minibatches of slots the cache lacks are collected; values them back to back and
+	// stores what is still current. with nothing queued and the sweep done it only waits, it doesn't rescan.
+	void fill()
+	{
+		for (;;)
+		{
+			int found = 0;
+			bool idle = false;
+			for (int chunk=0; chunk<filler_windows.size() && !idle; ++chunk)
+			{
+				std::lock_guard<std::mutex> lock(memory.mutex);
+				const int count = memory.count();
+				if (dirty.size() > count)
+				{
+					// pushes outran the filler : a sweep visits each slot once instead
+					dirty.clear();
+					sweep = 0;
+				}
+				for (int looked=0; looked<MinibatchSize; ++looked)
+				{
+					int index;
+					if (!dirty.empty())
+					{
+						index = dirty.front();
+						dirty.pop_front();
+					}
+					else if (sweep < count)
+					{
+						index = sweep++;
+					}
+					else
+					{
+						idle = true;
+						break;
+					}
+
+					const auto& e = memory.at(index);
+					if (!e.next_frame || (index < cache.size() && is_cached(index))) continue;
+
+					filler_indices[found] = index;
+					filler_stamps[found] = memory.stamp(index);
+					e.next_window(filler_windows[found / MinibatchSize][found % MinibatchSize]);
+					found++;
+				}
+			}
+
+			std::unique_lock<std::mutex> params_lock(params_mutex);
+			if (stopping) return;
+			if (found == 0)
+			{
+				if (idle)
+				{
+					// everything is current : wait for the next refresh, or for experiences to come in
+					refreshed.wait_for(params_lock,std::chrono::milliseconds(10));
+				}
+				continue;
+			}
+
+			const int minibatches = (found + MinibatchSize - 1) / MinibatchSize;
+			for (int i=found; i<minibatches * MinibatchSize; ++i)
+			{
+				filler_windows[i / MinibatchSize][i % MinibatchSize] = InputFrames();
+			}
+			const int computed_with = version;
+			for (int m=0; m<minibatches; ++m)
+			{
+				const auto& policies = filler_net->eval_for_train.evaluate(filler_windows[m],ActionMask().set());
+				for (int k=0; k<MinibatchSize; ++k)
+				{
+					filler_values[m * MinibatchSize + k] = policies[k].val;
+				}
+			}
+			params_lock.unlock();
+
+			std::lock_guard<std::mutex> lock(memory.mutex);
+			for (int i=0; i<found; ++i)
+			{
+				if (memory.stamp(filler_indices[i]) == filler_stamps[i])
+				{
+					store(filler_indices[i],filler_values[i],computed_with);
+				}
+			}
+		}
+	}
+
+	Network& learner;
+	ReplayMemory& memory;
+	boost::shared_ptr<Network> target, filler_net;
+
+	std::vector<Entry> cache; // by replay slot; guarded by memory.mutex
+	std::deque<int> dirty; // slots written since the filler took them; guarded by memory.mutex
+	int sweep; // next slot the filler visits after a refresh; guarded by memory.mutex
+	Values values;
+	std::array<InputFrames,MinibatchSize> windows;
+
+	// the filler's own
+	std::vector<std::array<InputFrames,MinibatchSize>> filler_windows; // target_fill_minibatches of them
+	std::vector<int> filler_indices;
+	std::vector<uint32_t> filler_stamps;
+	std::vector<float> filler_values;
+
+	std::mutex params_mutex; // held while the target's parameters are read by the filler or rewritten by refresh
+	std::condition_variable refreshed;
+	std::atomic<int> version; // read under memory.mutex by both threads, written only by refresh
+	int steps;
+	bool stopping;
+	std::thread filler;
+
+	Metrics::Gauge hits;
+};